@@ -0,0 +1 @@
+cmake -B build_native -DBOARD=native_posix . && make -C build_native && ./build_native/zephyr/zephyr.exe
@@ -5,3 +5,8 @@
   #undef DT_RTC_0_NAME
   #define DT_RTC_0_NAME			DT_NORDIC_NRF_RTC_RTC_2_LABEL
 #endif
+
+/* native_posix has no SX1276 node; the simulated radio (sim/) takes its name */
+#if defined(CONFIG_BOARD_NATIVE_POSIX) && !defined(DT_INST_0_SEMTECH_SX1276_LABEL)
+  #define DT_INST_0_SEMTECH_SX1276_LABEL	"SX1276"
+#endif
@@ -0,0 +1,31 @@
+/*
+ *  bench.h
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <zephyr.h>
+
+#ifdef CONFIG_BOARD_NATIVE_POSIX
+#include <time.h>
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*  Clock for micro-benchmarks.                                              */
+/*  On native_posix kernel time is simulated and does not advance while      */
+/*  code runs, so host process CPU time is used instead.                     */
+/*---------------------------------------------------------------------------*/
+static inline u64_t bench_now_ns(void)
+{
+#ifdef CONFIG_BOARD_NATIVE_POSIX
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return (u64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    return k_cyc_to_ns_floor64(k_cycle_get_32());
+#endif
+}
+
+#endif  // __BENCH_H__
@@ -8,6 +8,7 @@
 #include "ble_uuids.h" 
 
 bool ble_is_connected(void);
+u16_t ble_get_mtu(void);
 void bas_notify(void);
 
 int  ble_start_advertising(void);
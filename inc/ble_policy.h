@@ -4,6 +4,8 @@
 #ifndef __BLE_POLICY_H__
 #define __BLE_POLICY_H__
 
+#include <kernel.h>
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
@@ -29,6 +31,30 @@ typedef enum {
 
 #define MAX_DEVICEID_STRING_LEN 16
 
+/*
+ *  A VOICE write carries an array of little-endian u32_t commands, up to
+ *  one full ATT payload (MTU - 3 bytes) of them.  Keep BLE_ATT_MTU in step
+ *  with CONFIG_BT_L2CAP_RX_MTU in prj.conf.
+ */
+#define BLE_ATT_MTU             247
+#define BLE_CMD_BATCH_MAX       ((BLE_ATT_MTU - 3) / sizeof(u32_t))
+
+/*
+ *  Command queue.  Nothing is discarded once queued: a message that does
+ *  not fit is refused (-ENOMEM) and a GATT write fails with an ATT error,
+ *  so the client can retry.  STOP commands go through their own lane and
+ *  are serviced ahead of queued motion commands.
+ */
+#define BLE_QUEUE_DEPTH         64      // at least BLE_CMD_BATCH_MAX
+#define BLE_QUEUE_URGENT_DEPTH  4
+
+struct ble_queue_stats {
+    u32_t enqueued;
+    u32_t urgent;       // of which took the STOP lane
+    u32_t refused;      // messages turned away because the queue was full
+    u32_t high_water;   // most messages ever waiting, both lanes
+};
+
 extern int  DeviceIdLen;
 extern char DeviceId [MAX_DEVICEID_STRING_LEN];
 
@@ -36,7 +62,12 @@ extern char DeviceId [MAX_DEVICEID_STRING_LEN];
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
 int  ble_enqueue_msg(ble_event_t charact, u32_t data);
+int  ble_enqueue_batch(ble_event_t charact, const u8_t * buf, u16_t count);
 void ble_operation_complete(ble_event_t charact, u32_t code);
+int  ble_queue_drain(void);
+void ble_queue_poll_init(struct k_poll_event * event);
+void ble_queue_get_stats(struct ble_queue_stats * stats);
+int  ble_command(u32_t data);
 int  ble_policy_init(void);
 void ble_device_name(void);
 
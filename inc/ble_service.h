@@ -24,8 +24,62 @@ struct ble_reps {
 typedef struct ble_reps ble_reps_t;
 
 /*---------------------------------------------------------------------------*/
+/*  Command results                                                          */
 /*                                                                           */
+/*  Results are coalesced: one notification carries as many {cmd, code}      */
+/*  records (two little-endian u32_t each) as the connection MTU allows.     */
+/*  A notification goes out when it is full or PASTE_NOTIFY_FLUSH_MS after   */
+/*  its first record.  When the stack is out of TX buffers the records stay  */
+/*  in a backlog and are retried; past PASTE_NOTIFY_BACKLOG the oldest are   */
+/*  dropped.                                                                 */
 /*---------------------------------------------------------------------------*/
-int paste_notify(u32_t cmd, u32_t code);
+#define PASTE_NOTIFY_FLUSH_MS   20
+#define PASTE_NOTIFY_RETRY_MS   10
+#define PASTE_NOTIFY_BACKLOG    64      // records
+
+struct paste_notify_stats {
+    u32_t results;      // records accepted
+    u32_t packets;      // notifications sent
+    u32_t retries;      // sends deferred for lack of TX buffers
+    u32_t dropped;      // records lost: backlog overflow, error or disconnect
+};
+
+int  paste_notify(u32_t cmd, u32_t code);
+void paste_notify_get_stats(struct paste_notify_stats * stats);
+
+/*---------------------------------------------------------------------------*/
+/*  LoRa RX characteristic (see lora_bridge.h for the payload)               */
+/*---------------------------------------------------------------------------*/
+bool paste_lora_subscribed(void);
+int  paste_lora_notify(const u8_t * data, u16_t len);
+
+/*---------------------------------------------------------------------------*/
+/*  LoRa TX characteristic (uplink)                                          */
+/*                                                                           */
+/*  Write [tag][dst][len][payload], with or without response; a long write   */
+/*  may carry it in several chunks.  Writes pipeline up to the LoRa TX       */
+/*  queue depth.  Each frame's outcome comes back as a notification on the   */
+/*  same characteristic, several records packed per notification:            */
+/*                                                                           */
+/*     0       1       2 ... 5                                               */
+/*  +-------+-------+--------------+                                         */
+/*  |  tag  | status| airtime (LE) |   status: 0 sent, else -errno (s8)     */
+/*  +-------+-------+--------------+   airtime: microseconds on air          */
+/*                                                                           */
+/*  A write request the TX queue cannot take fails with an ATT error; a      */
+/*  write command gets a completion with status -ENOMEM instead.             */
+/*---------------------------------------------------------------------------*/
+#define PASTE_UPLINK_HDR_LEN    3
+#define PASTE_UPLINK_DONE_LEN   6
+#define PASTE_UPLINK_BACKLOG    16      // completions waiting to be notified
+
+struct paste_uplink_stats {
+    u32_t queued;       // frames handed to the LoRa TX queue
+    u32_t refused;      // frames the TX queue could not take
+    u32_t completions;  // completion records notified
+    u32_t dropped;      // completion records lost
+};
+
+void paste_uplink_get_stats(struct paste_uplink_stats * stats);
 
 #endif  // __BLE_SERVICE_H__
\ No newline at end of file
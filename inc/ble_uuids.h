@@ -12,6 +12,10 @@
 #define PASTE_UUID_SERVICE            0x00,0x00
 #define PASTE_UUID_NOTIFY             0x01,0x00
 #define PASTE_UUID_VOICE              0x02,0x00
+#define PASTE_UUID_LORA_RX            0x03,0x00
+#define PASTE_UUID_LORA_TX            0x04,0x00
+#define PASTE_UUID_METRICS            0x05,0x00
+#define PASTE_UUID_CONFIG             0x06,0x00
 
 /*
  *  Service UUID:
@@ -28,4 +32,16 @@
 #define BT_UUID_PASTE_VOICE   \
     BT_UUID_DECLARE_128(PASTE_UUID_VOICE, PASTE_UUID_BASE)
 
+#define BT_UUID_PASTE_LORA_RX   \
+    BT_UUID_DECLARE_128(PASTE_UUID_LORA_RX, PASTE_UUID_BASE)
+
+#define BT_UUID_PASTE_LORA_TX   \
+    BT_UUID_DECLARE_128(PASTE_UUID_LORA_TX, PASTE_UUID_BASE)
+
+#define BT_UUID_PASTE_METRICS   \
+    BT_UUID_DECLARE_128(PASTE_UUID_METRICS, PASTE_UUID_BASE)
+
+#define BT_UUID_PASTE_CONFIG   \
+    BT_UUID_DECLARE_128(PASTE_UUID_CONFIG, PASTE_UUID_BASE)
+
 #endif  // __BLE_UUIDS_H__
\ No newline at end of file
@@ -0,0 +1,52 @@
+/*
+ *  lora_adr.h
+ */
+#ifndef __LORA_ADR_H__
+#define __LORA_ADR_H__
+
+#include <zephyr/types.h>
+#include <drivers/lora.h>
+
+/*
+ *   Adaptive data rate.  Link quality is learned from the SNR of frames
+ *   received from each peer; TX power is chosen per link.  The spreading
+ *   factor is shared by TX and RX, so every node must move together.  Each
+ *   node works out the SF its weakest active link needs and sends it in
+ *   every frame (lora_frame.h); the network SF is the highest need heard.
+ *   A node changes SF only right after sending a frame that carries its
+ *   new need, and peers that hear that frame follow at once, so no frame
+ *   is sent at an SF its neighbours have not been told about.
+ */
+#define LORA_ADR_SF_MIN         SF_7
+#define LORA_ADR_SF_MAX         SF_12
+#define LORA_ADR_POWER_MIN      2       // dBm
+#define LORA_ADR_POWER_MAX      14      // dBm
+#define LORA_ADR_POWER_STEP     3       // dB
+#define LORA_ADR_MARGIN_DB      10      // installation margin above SNR floor
+#define LORA_ADR_SETTLE_FRAMES  8       // frames between SF decreases
+#define LORA_ADR_SILENCE_MS     60000   // link expiry; unheard: step SF up
+#define LORA_ADR_MAX_LINKS      8
+
+struct lora_adr_link {
+    u32_t last_seen;
+    s16_t snr_q4;           // SNR average, dB * 16
+    s16_t rssi;             // RSSI average, dBm
+    u16_t frames;
+    u8_t  id;
+    u8_t  need;             // SF the peer announced, 0 if none
+    bool  used;
+};
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_adr_init(enum lora_datarate datarate);
+void lora_adr_update(u8_t src, s16_t rssi, s8_t snr, u8_t sf, u32_t now);
+void lora_adr_tx_done(u32_t now);
+void lora_adr_tick(u32_t now);
+enum lora_datarate lora_adr_datarate(void);
+enum lora_datarate lora_adr_need(void);
+s8_t lora_adr_tx_power(u8_t dst, u32_t now);
+const struct lora_adr_link * lora_adr_link_get(u8_t id);
+
+#endif  // __LORA_ADR_H__
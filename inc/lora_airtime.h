@@ -0,0 +1,35 @@
+/*
+ *  lora_airtime.h
+ */
+#ifndef __LORA_AIRTIME_H__
+#define __LORA_AIRTIME_H__
+
+#include <zephyr/types.h>
+#include <drivers/lora.h>
+
+/*
+ *   Duty-cycle budget, enforced with a token bucket of airtime; a permille
+ *   of 0 disables the limiter.  The regulatory region is a Kconfig choice
+ *   (Kconfig: LORA_APP_REGION); EU868, the default, allows 1% of airtime
+ *   over one hour, and US915 sets no limit unless
+ *   CONFIG_LORA_APP_DUTY_CYCLE_PERMILLE imposes one.  Refill is trimmed so
+ *   that a full burst plus one window of refill never exceeds the budget
+ *   over any window.  The bucket holds the longest legal frame, 255 bytes
+ *   at SF12/125kHz (9.02s), so any single frame can be sent once enough
+ *   budget has built up.
+ */
+#define LORA_DUTY_CYCLE_PERMILLE    CONFIG_LORA_APP_DUTY_CYCLE_PERMILLE
+#define LORA_DUTY_WINDOW_MS         3600000     // 1 hour
+#define LORA_DUTY_BURST_US          9100000     // bucket size: 9.1s airtime
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+u32_t lora_airtime_us(const struct lora_modem_config * config, u8_t len);
+
+void  lora_duty_init(u32_t now);
+u32_t lora_duty_budget_us(u32_t now);
+u32_t lora_duty_wait_ms(u32_t airtime_us, u32_t now);
+int   lora_duty_consume(u32_t airtime_us, u32_t now);
+
+#endif  // __LORA_AIRTIME_H__
@@ -4,14 +4,174 @@
 #ifndef __LORA_APP_H__
 #define __LORA_APP_H__
 
+#include <zephyr/types.h>
+#include <kernel.h>
+
+#include "lora_frame.h"
+
+/*
+ *   The radio scheduler interleaves TX and RX on the single half-duplex
+ *   SX1276: queued frames are sent back-to-back within the duty-cycle
+ *   budget (lora_airtime.h), and otherwise the radio listens in RX windows
+ *   of LORA_APP_RX_WINDOW_MS, which also bounds how long a newly queued
+ *   frame waits for the radio.
+ */
+#define LORA_APP_RX_WINDOW_MS       200
+#define LORA_APP_FREQUENCY          915000000   // default (node_config.h)
+#define LORA_APP_TX_QUEUE_DEPTH     8
+#define LORA_APP_MAX_FRAME_LEN      255
+
+/*
+ *   Received frames are read straight into buffers from a fixed pool and
+ *   handed to consumers by pointer.  If every buffer is held by consumers,
+ *   new frames are received into a scratch buffer and dropped, except
+ *   that ACKs are still consumed and polls still answered.
+ */
+#define LORA_APP_RX_POOL_FRAMES     4
+
+/*
+ *   Frames are delivered either to the RX FIFO (lora_app_rx_get, or k_poll
+ *   through lora_app_rx_poll_init) or, when one is registered, straight to
+ *   the RX callback on the radio thread.  After a radio error the radio is
+ *   reconfigured and receive re-armed, backing off from
+ *   LORA_APP_RETRY_MIN_MS up to LORA_APP_RETRY_MAX_MS while errors persist.
+ */
+#define LORA_APP_RETRY_MIN_MS       10
+#define LORA_APP_RETRY_MAX_MS       1000
+
+/*
+ *   Demo producer: the "hello, world" frame is queued at this period.
+ *   TX rate is reported every LORA_APP_RATE_WINDOW_MS.
+ */
+#define LORA_APP_BEACON_PERIOD_MS   5000
+#define LORA_APP_RATE_WINDOW_MS     10000
+
 /*
- *   If LORA_APP_TX_MODE is defined then build for TX
- *   IF LORA_APP_TX_MODE is not defined (comment out) then build for RX.
+ *   Power modes.  ALWAYS_ON listens back-to-back and is the default.  LOW,
+ *   opt-in for battery nodes, sleeps the radio for LORA_APP_SLEEP_MS after
+ *   each RX window that hears nothing, and wakes early when a frame is
+ *   queued; it hears only about one frame in ten from peers that send the
+ *   normal 8-symbol preamble, so they must retry (reliable delivery).
+ *   Wake-up latency (how late the radio thread resumes) is tracked in the
+ *   stats.
  */
- #define LORA_APP_TX_MODE 1
+#define LORA_APP_SLEEP_MS           1800
+
+typedef enum {
+    LORA_APP_POWER__ALWAYS_ON = 0,
+    LORA_APP_POWER__LOW,
+} lora_app_power_t;
+
+#define LORA_APP_POWER_DEFAULT      LORA_APP_POWER__ALWAYS_ON
+
+/*
+ *   TX completion: frames queued with a tag other than LORA_APP_TAG_NONE are
+ *   reported to the registered callback, on the radio thread, once they are
+ *   on air (status 0) or dropped (negative errno).  Keep the callback short.
+ */
+#define LORA_APP_TAG_NONE           0
+
+/*
+ *   Reliable delivery (lora_app_set_reliable).  Unicast frames to one peer
+ *   are kept in a window of up to LORA_APP_ARQ_WINDOW and sent back to
+ *   back, the last with the POLL flag; the peer answers with a selective
+ *   ACK (lora_frame.h).  Frames it lacks are resent at once, and all
+ *   unacknowledged ones when no ACK arrives within its time on air plus
+ *   LORA_APP_ARQ_ACK_MARGIN_MS.  After LORA_APP_ARQ_RETRIES resends a frame
+ *   is reported failed (-ETIMEDOUT); otherwise its TX completion reports the
+ *   acknowledgement.  Every node answers polls, whatever its own mode.
+ */
+#define LORA_APP_RELIABLE           false   // at boot
+#define LORA_APP_ARQ_WINDOW         4
+#define LORA_APP_ARQ_RETRIES        3
+#define LORA_APP_ARQ_ACK_MARGIN_MS  100
+
+typedef void (*lora_app_tx_cb_t)(u16_t tag, int status, u32_t airtime_us);
+
+/*---------------------------------------------------------------------------*/
+/*  Radio direction and scheduler statistics                                 */
+/*---------------------------------------------------------------------------*/
+typedef enum {
+    LORA_DIR__NONE = 0,
+    LORA_DIR__RX,
+    LORA_DIR__TX,
+} lora_dir_t;
+
+typedef struct lora_rx_frame {
+    void * fifo_reserved;       // first word reserved for k_fifo
+    u32_t  timestamp;           // k_uptime_get_32() at reception
+    s16_t  rssi;
+    s8_t   snr;
+    u8_t   len;                 // on-air length, header and CRC included
+    struct lora_frame_hdr hdr;  // payload at LORA_FRAME_PAYLOAD(data)
+    u8_t   data[LORA_APP_MAX_FRAME_LEN];
+} lora_rx_frame_t;
+
+struct lora_app_stats {
+    u32_t turnarounds;          // number of RX<->TX direction changes
+    u32_t turnaround_last_us;   // last reconfigure time
+    u32_t turnaround_max_us;    // worst reconfigure time
+    u32_t reconfigs;            // SF/power changes without turnaround
+    u32_t retunes;              // frequency-only changes (hopping)
+    u32_t tx_frames;
+    u32_t first_tx_ms;          // uptime at the first frame on air
+    u32_t tx_errors;
+    u32_t tx_queue_full;        // lora_app_enqueue calls refused
+    u32_t tx_latency_last_us;   // enqueue-to-airtime of last new frame
+    u32_t tx_latency_max_us;
+    u32_t tx_latency_avg_us;
+    u32_t tx_rate_mfps;         // milli-frames/sec over last rate window,
+                                // first sends only: no ACKs or resends
+    u32_t tx_airtime_ms;        // total time on air
+    u32_t tx_duty_deferred;     // scheduler passes spent waiting for budget
+    u32_t tx_bytes;             // on air: headers, ACKs and resends included
+    u32_t goodput_bytes;        // payload delivered: acknowledged, or sent
+                                // once when not reliable
+    u32_t throughput_bps;       // tx_bytes over the last rate window
+    u32_t goodput_bps;          // goodput_bytes over the last rate window
+    u32_t arq_retransmissions;
+    u32_t arq_timeouts;         // no ACK in time after a poll
+    u32_t arq_acked;
+    u32_t arq_failed;           // out of retries, or dropped
+    u32_t acks_sent;
+    u32_t acks_received;
+    u32_t duty_budget_us;       // airtime that may be spent right now
+    u32_t rx_frames;
+    u32_t rx_windows;
+    u32_t rx_pool_empty;        // frames dropped: no free RX buffer
+    u32_t rx_bad_frames;        // length or CRC check failed
+    u32_t rx_not_for_us;
+    u32_t rx_duplicates;
+    u32_t radio_errors;         // failed config, send or receive
+    u32_t radio_recoveries;     // re-arms after an error
+    u32_t sleeps;               // low-power sleep periods
+    u32_t sleep_wakes_early;    // of which cut short by a queued frame
+    u32_t wake_latency_last_us; // timer or enqueue to radio thread running
+    u32_t wake_latency_max_us;
+};
+
+/* Owns the frame: release it with lora_app_rx_release() */
+typedef void (*lora_app_rx_cb_t)(lora_rx_frame_t * frame);
+
+int   lora_app_init(void);
+void  lora_app_run(void);
+int   lora_app_set_direction(lora_dir_t dir);
+u32_t lora_app_turnaround_us(void);
+void  lora_app_get_stats(struct lora_app_stats * stats);
+u32_t lora_app_next_send_ms(void);
+int   lora_app_enqueue(u8_t dst, const u8_t * data, u8_t len, s32_t timeout);
+int   lora_app_enqueue_tagged(u8_t dst, const u8_t * data, u8_t len, u16_t tag,
+                              s32_t timeout);
+int   lora_app_enqueue_flags(u8_t dst, const u8_t * data, u8_t len, u16_t tag,
+                             u8_t flags, s32_t timeout);
+u32_t lora_app_airtime_us(u8_t len);
+void  lora_app_set_tx_callback(lora_app_tx_cb_t cb);
+void  lora_app_set_power_mode(lora_app_power_t mode);
+void  lora_app_set_reliable(bool enable);
 
-int  lora_app_init(void);
-void lora_app_send(void);
-void lora_app_receive(void);
+lora_rx_frame_t * lora_app_rx_get(s32_t timeout);
+void  lora_app_rx_release(lora_rx_frame_t * frame);
+void  lora_app_rx_poll_init(struct k_poll_event * event);
+void  lora_app_set_rx_callback(lora_app_rx_cb_t cb);
 
-#endif  // __LORA_APP_H__
\ No newline at end of file
+#endif  // __LORA_APP_H__
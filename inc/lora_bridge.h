@@ -0,0 +1,63 @@
+/*
+ *  lora_bridge.h
+ */
+#ifndef __LORA_BRIDGE_H__
+#define __LORA_BRIDGE_H__
+
+#include <zephyr/types.h>
+
+#include "lora_app.h"
+
+/*---------------------------------------------------------------------------*/
+/*  LoRa to BLE bridge                                                       */
+/*                                                                           */
+/*  Each received frame is forwarded on the LoRa RX characteristic as one    */
+/*  record per notification chunk:                                           */
+/*                                                                           */
+/*     0       1       2       3 ...                                         */
+/*  +-------+-------+-------+-------------+                                  */
+/*  |  id   | frag  | size  |    chunk    |   frag = index << 4 | (count-1) */
+/*  +-------+-------+-------+-------------+                                  */
+/*                                                                           */
+/*  Small frames are packed several records to a notification; a frame       */
+/*  larger than one notification is split into up to 16 chunks sharing      */
+/*  the same id.  The chunks, joined, hold:                                  */
+/*                                                                           */
+/*     0       1       2       3       4       5       6       7       8 ... */
+/*  +-------+-------+-------+-------+-------+-------+-------+-------+------+ */
+/*  |  src  |  dst  |  seq  | flags |  rssi (LE)    |  snr  |  len  | data | */
+/*  +-------+-------+-------+-------+-------+-------+-------+-------+------+ */
+/*                                                                           */
+/*  Frames wait in a queue of LORA_BRIDGE_QUEUE_DEPTH; when the phone falls  */
+/*  behind the oldest is dropped, so reception never waits on BLE.           */
+/*                                                                           */
+/*  The bridge runs from the application event loop: it polls on            */
+/*  LORA_BRIDGE_POLL_EVENTS events and lora_bridge_service() does the work   */
+/*  without blocking; a notification the stack has no buffer for is kept    */
+/*  and retried after LORA_BRIDGE_RETRY_MS.                                  */
+/*---------------------------------------------------------------------------*/
+#define LORA_BRIDGE_QUEUE_DEPTH     (LORA_APP_RX_POOL_FRAMES - 1)
+#define LORA_BRIDGE_RETRY_MS        10
+#define LORA_BRIDGE_POLL_EVENTS     2
+
+#define LORA_BRIDGE_RECORD_HDR      3
+#define LORA_BRIDGE_META_LEN        8
+
+struct lora_bridge_stats {
+    u32_t frames;       // frames accepted for forwarding
+    u32_t evicted;      // dropped from the queue to make room
+    u32_t packets;      // notifications sent
+    u32_t retries;      // sends deferred for lack of TX buffers
+    u32_t fragmented;   // frames that needed more than one chunk
+    u32_t dropped;      // frames lost to disconnect or BLE errors
+};
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int  lora_bridge_forward(lora_rx_frame_t * frame);
+void lora_bridge_poll_init(struct k_poll_event * events);
+void lora_bridge_service(void);
+void lora_bridge_get_stats(struct lora_bridge_stats * stats);
+
+#endif  // __LORA_BRIDGE_H__
@@ -0,0 +1,66 @@
+/*
+ *  lora_codec.h
+ */
+#ifndef __LORA_CODEC_H__
+#define __LORA_CODEC_H__
+
+#include <zephyr/types.h>
+
+#include "ble_service.h"
+
+/*
+ *   Payload compression.  Every byte costs time on air, so two encodings
+ *   shrink what goes out:
+ *
+ *   - Telemetry: a ble_reps_t report as varints.  Node ids are zigzag
+ *     deltas from the previous entry, distances are quantized to
+ *     LORA_CODEC_DIST_SCALE steps per metre; the 71 byte report of ten
+ *     nodes typically packs into about 40.
+ *
+ *   - Dictionary: any payload, with runs matching an entry of a small
+ *     fixed dictionary replaced by a one byte token.  The scheduler tries
+ *     it on every frame and keeps the result, with LORA_FRAME_FLAG_CODEC
+ *     set, only when it is shorter; the receiver expands it before the
+ *     frame is delivered.  Both ends must share the dictionary.
+ */
+#define LORA_CODEC_ENABLED          1
+#define LORA_CODEC_DIST_SCALE       100     // centimetres
+#define LORA_CODEC_REPS_MAX_LEN     (1 + 10 * (3 + 5 + 1))
+
+struct lora_codec_stats {
+    u32_t frames;               // frames offered to the dictionary coder
+    u32_t compressed;           // ... that came out shorter
+    u32_t bytes_in;
+    u32_t bytes_out;            // bytes_in - bytes_out saved on air
+    u32_t encode_cycles;        // CPU cycles (DWT), average per frame offered
+    u32_t decoded;
+    u32_t decode_cycles;        // CPU cycles (DWT), average per frame expanded
+    u32_t decode_errors;
+};
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int  lora_codec_varint_put(u8_t * buf, size_t size, u32_t value);
+int  lora_codec_varint_get(const u8_t * buf, size_t len, u32_t * value);
+
+static inline u32_t lora_codec_zigzag(s32_t value)
+{
+    return ((u32_t)value << 1) ^ (u32_t)(value >> 31);
+}
+
+static inline s32_t lora_codec_unzigzag(u32_t value)
+{
+    return (s32_t)(value >> 1) ^ -(s32_t)(value & 1);
+}
+
+int  lora_codec_reps_encode(const ble_reps_t * reps, u8_t * buf, size_t size);
+int  lora_codec_reps_decode(const u8_t * buf, size_t len, ble_reps_t * reps);
+
+int  lora_codec_compress(const u8_t * in, u8_t len, u8_t * out, size_t size);
+int  lora_codec_expand(const u8_t * in, u8_t len, u8_t * out, size_t size);
+
+void lora_codec_get_stats(struct lora_codec_stats * stats);
+void lora_codec_bench(u32_t iterations);
+
+#endif  // __LORA_CODEC_H__
@@ -0,0 +1,60 @@
+/*
+ *  lora_frag.h
+ */
+#ifndef __LORA_FRAG_H__
+#define __LORA_FRAG_H__
+
+#include <zephyr/types.h>
+#include <kernel.h>
+
+/*---------------------------------------------------------------------------*/
+/*  Fragment layout (payload of a frame with LORA_FRAME_FLAG_FRAG)           */
+/*                                                                           */
+/*      0        1        2        3        4 ...                            */
+/*  +--------+--------+--------+--------+------------+                       */
+/*  | msg id | index  | count  |  size  |   chunk    |                       */
+/*  +--------+--------+--------+--------+------------+                       */
+/*                                                                           */
+/*  Every fragment but the last carries "size" bytes; fragment n of a        */
+/*  message lives at offset n * size.                                        */
+/*---------------------------------------------------------------------------*/
+#define LORA_FRAG_HDR_LEN           4
+
+/*
+ *   Messages up to LORA_FRAG_MAX_LEN are split into fragments sized for the
+ *   least total time on air at the current SF, within the duty-cycle bucket
+ *   (and, when hopping, no longer than a slot); lora_frag_send() fails with
+ *   -EMSGSIZE when no size fits.  The receiver reassembles up to
+ *   LORA_FRAG_POOL messages at once in preallocated buffers, in any
+ *   fragment order.  A message that receives no fragment for
+ *   LORA_FRAG_TIMEOUT_MS is evicted; at a 1% duty cycle a full-size
+ *   fragment may take tens of seconds to follow.
+ */
+#define LORA_FRAG_MAX_LEN           4096
+#define LORA_FRAG_POOL              2
+#define LORA_FRAG_TIMEOUT_MS        120000
+
+struct lora_frag_stats {
+    u32_t tx_messages;
+    u32_t tx_fragments;
+    u32_t rx_fragments;
+    u32_t rx_messages;          // reassembled and delivered
+    u32_t rx_evicted;           // timed out incomplete
+    u32_t rx_dropped;           // malformed, too large or no free buffer
+};
+
+/* Runs on the radio thread; "msg" is only valid during the call */
+typedef void (*lora_frag_rx_cb_t)(u8_t src, const u8_t * msg, u16_t len);
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_frag_init(void);
+u8_t lora_frag_size(u16_t len);
+int  lora_frag_send(u8_t dst, const u8_t * msg, u16_t len, s32_t timeout);
+void lora_frag_set_rx_callback(lora_frag_rx_cb_t cb);
+void lora_frag_input(u8_t src, const u8_t * fragment, u8_t len, u32_t now);
+void lora_frag_tick(u32_t now);
+void lora_frag_get_stats(struct lora_frag_stats * stats);
+
+#endif  // __LORA_FRAG_H__
@@ -0,0 +1,101 @@
+/*
+ *  lora_frame.h
+ */
+#ifndef __LORA_FRAME_H__
+#define __LORA_FRAME_H__
+
+#include <zephyr/types.h>
+#include <stddef.h>
+
+/*---------------------------------------------------------------------------*/
+/*  Frame layout                                                             */
+/*                                                                           */
+/*    0     1     2     3      4     5     6 ... 6+len-1   6+len   7+len     */
+/*  +-----+-----+-----+-------+-----+------+------------+-------+-------+    */
+/*  | dst | src | seq | flags | len | slot |  payload   |  CRC16 (LE)   |    */
+/*  +-----+-----+-----+-------+-----+------+------------+-------+-------+    */
+/*                                                                           */
+/*  The first four bytes keep the RadioHead TO/FROM/ID/FLAGS order.          */
+/*  "slot" is how far into its hop slot the sender was when it built the     */
+/*  frame, in LORA_FRAME_SLOT_UNIT_MS steps, or LORA_FRAME_SLOT_NONE when    */
+/*  it is not hopping (lora_hop.h).                                          */
+/*  The CRC is CRC-16/CCITT over header and payload.                         */
+/*---------------------------------------------------------------------------*/
+#define LORA_FRAME_HDR_LEN          6
+#define LORA_FRAME_CRC_LEN          2
+#define LORA_FRAME_OVERHEAD         (LORA_FRAME_HDR_LEN + LORA_FRAME_CRC_LEN)
+#define LORA_FRAME_MAX_LEN          255
+#define LORA_FRAME_MAX_PAYLOAD      (LORA_FRAME_MAX_LEN - LORA_FRAME_OVERHEAD)
+
+#define LORA_FRAME_BROADCAST        0xFF
+
+#define LORA_FRAME_SLOT_UNIT_MS     2
+#define LORA_FRAME_SLOT_NONE        0xFF
+
+/*
+ *   Flags, in the low nibble that RadioHead leaves to applications.
+ *   POLL asks the destination for a selective ACK: a frame with the ACK
+ *   flag whose payload is the destination's duplicate-filter state for
+ *   the sender, the newest sequence number heard and a bitmap of the 32
+ *   before it (bit n: last_seq - n received).
+ */
+#define LORA_FRAME_FLAG_POLL        0x01
+#define LORA_FRAME_FLAG_ACK         0x02
+#define LORA_FRAME_FLAG_FRAG        0x04    // payload is a fragment (lora_frag.h)
+#define LORA_FRAME_FLAG_CODEC       0x08    // dictionary coded (lora_codec.h)
+
+/*
+ *   The high nibble, RadioHead's own flags, carries the spreading factor
+ *   the sender's links need (7-12, 0 for none); see lora_adr.h.
+ */
+#define LORA_FRAME_SF_MASK          0xF0
+#define LORA_FRAME_SF_SHIFT         4
+#define LORA_FRAME_SF_GET(flags)    (((flags) & LORA_FRAME_SF_MASK) >> LORA_FRAME_SF_SHIFT)
+#define LORA_FRAME_SF_SET(sf)       (((sf) << LORA_FRAME_SF_SHIFT) & LORA_FRAME_SF_MASK)
+
+#define LORA_FRAME_SACK_LEN         5       // last_seq, window (LE32)
+
+#define LORA_FRAME_PAYLOAD(buf)     ((buf) + LORA_FRAME_HDR_LEN)
+
+struct lora_frame_hdr {
+    u8_t dst;
+    u8_t src;
+    u8_t seq;
+    u8_t flags;
+    u8_t len;
+    u8_t slot;
+};
+
+/*---------------------------------------------------------------------------*/
+/*  Duplicate filter: a sliding window of recent sequence numbers per peer.  */
+/*---------------------------------------------------------------------------*/
+#define LORA_FRAME_MAX_PEERS        8
+#define LORA_FRAME_DEDUP_WINDOW     32
+#define LORA_FRAME_DEDUP_TIMEOUT_MS 60000
+
+struct lora_frame_peer {
+    u32_t last_seen;
+    u32_t window;       // bit n set: (last_seq - n) has been received
+    u8_t  last_seq;
+    u8_t  src;
+    bool  used;
+};
+
+struct lora_frame_dedup {
+    struct lora_frame_peer peer[LORA_FRAME_MAX_PEERS];
+};
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int  lora_frame_encode(u8_t * buf, size_t size, const struct lora_frame_hdr * hdr);
+int  lora_frame_decode(const u8_t * buf, size_t len, struct lora_frame_hdr * hdr);
+int  lora_frame_accept(struct lora_frame_dedup * dedup,
+                       const struct lora_frame_hdr * hdr,
+                       u8_t node_id, u32_t now);
+int  lora_frame_sack_get(struct lora_frame_dedup * dedup, u8_t src,
+                         u8_t * last_seq, u32_t * window);
+bool lora_frame_sack_covers(u8_t last_seq, u32_t window, u8_t seq);
+void lora_frame_bench(u32_t iterations);
+
+#endif  // __LORA_FRAME_H__
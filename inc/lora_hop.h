@@ -0,0 +1,84 @@
+/*
+ *  lora_hop.h
+ */
+#ifndef __LORA_HOP_H__
+#define __LORA_HOP_H__
+
+#include <zephyr/types.h>
+
+/*
+ *   Frequency hopping.  Time is cut into slots of LORA_HOP_DWELL_MS; every
+ *   node visits the channels of the plan in the same pseudo-random order
+ *   (from LORA_HOP_SEED), one per slot.  A frame is started no earlier
+ *   than LORA_HOP_GUARD_MS into a slot and, before LBT and radio
+ *   reconfiguration, no later than LORA_HOP_TX_SLACK_MS after that.  Each
+ *   frame carries how far into its slot the sender was (lora_frame.h), so
+ *   a receiver knows where the sender's slot began: followers take their
+ *   slot timing from each frame of the master (LORA_HOP_MASTER_ID), which
+ *   keeps its own.  A follower that has
+ *   not heard the master for LORA_HOP_SYNC_TIMEOUT_MS waits on the
+ *   rendezvous channel (plan entry 0) until it hears it again.
+ *
+ *   Each channel keeps the success rate, RSSI and noise (RSSI - SNR) of the
+ *   frames received on it.  Senders skip the slots of channels that fall
+ *   below LORA_HOP_MIN_SUCCESS_PERMILLE or more than LORA_HOP_NOISE_MARGIN_DB
+ *   above the quietest channel, and probe them again after
+ *   LORA_HOP_PROBE_MS.  Receivers still visit every channel, so the choice
+ *   needs no agreement between nodes.
+ */
+#define LORA_HOP_CHANNELS_MAX           16
+#define LORA_HOP_DWELL_MS               400     // FCC 15.247 limit per channel
+#define LORA_HOP_GUARD_MS               20      // retune margin at slot start
+#define LORA_HOP_TX_SLACK_MS            40      // late start still allowed
+#define LORA_HOP_SEED                   0x4C4F5241
+#define LORA_HOP_MASTER_ID              1
+#define LORA_HOP_SYNC_TIMEOUT_MS        60000
+#define LORA_HOP_MIN_SUCCESS_PERMILLE   700
+#define LORA_HOP_NOISE_MARGIN_DB        6
+#define LORA_HOP_PROBE_MS               30000
+#define LORA_HOP_ENABLED                0       // at boot; see lora_hop_set_enabled
+
+/* US915 sub-band 2, 125kHz channels 8..15 */
+#define LORA_HOP_PLAN_US915_SB2 { \
+    903900000, 904100000, 904300000, 904500000, \
+    904700000, 904900000, 905100000, 905300000, \
+}
+
+struct lora_hop_channel {
+    u32_t frequency;
+    u32_t last_tx;
+    u32_t tx_frames;
+    u32_t rx_frames;
+    u32_t rx_bad;
+    u16_t success;          // received frames that decoded, permille average
+    s16_t rssi;             // average of good frames, dBm
+    s16_t noise;            // average of RSSI - SNR, dBm
+};
+
+struct lora_hop_stats {
+    u32_t syncs;            // slot timing taken from a received frame
+    u32_t sync_lost;
+    u32_t slots_skipped;    // TX slots passed over for a poor channel
+    u32_t overruns;         // frames longer than a slot
+};
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void  lora_hop_init(bool master, u32_t now);
+int   lora_hop_set_plan(const u32_t * frequencies, u8_t count);
+void  lora_hop_set_enabled(bool enabled);
+bool  lora_hop_enabled(void);
+u8_t  lora_hop_channel(u32_t now);
+u32_t lora_hop_frequency(u8_t channel);
+u32_t lora_hop_slot_remaining_ms(u32_t now);
+u32_t lora_hop_slot_offset_ms(u32_t now);
+u32_t lora_hop_tx_wait_ms(u32_t now);
+void  lora_hop_tx_done(u8_t channel, u32_t airtime_us, u32_t now);
+void  lora_hop_rx_update(u8_t channel, bool ok, s16_t rssi, s8_t snr);
+void  lora_hop_sync(u8_t src, u8_t channel, u32_t offset_ms,
+                    u32_t airtime_us, u32_t now);
+const struct lora_hop_channel * lora_hop_channel_get(u8_t channel);
+void  lora_hop_get_stats(struct lora_hop_stats * stats);
+
+#endif  // __LORA_HOP_H__
@@ -0,0 +1,46 @@
+/*
+ *  lora_lbt.h
+ */
+#ifndef __LORA_LBT_H__
+#define __LORA_LBT_H__
+
+#include <zephyr/types.h>
+
+/*
+ *   Listen-before-talk.  Before each send the channel RSSI is sampled for
+ *   LORA_LBT_SENSE_MS; above LORA_LBT_RSSI_THRESHOLD the channel is busy
+ *   and the frame backs off for a random number of slots, the slot being
+ *   the frame's own time on air.  The contention window doubles from
+ *   LORA_LBT_CW_MIN up to LORA_LBT_CW_MAX with each busy attempt; after
+ *   LORA_LBT_MAX_ATTEMPTS the frame is dropped (-EBUSY) rather than sent
+ *   into a collision.  Threshold and sense time follow the AS923 LBT rule.
+ *
+ *   Carrier sense only hears signals above the noise floor, so distant
+ *   LoRa senders still collide; those collisions show up as rx_bad_frames
+ *   (CRC failures) in the receivers' lora_app_stats.
+ */
+#define LORA_LBT_ENABLED            1
+#define LORA_LBT_RSSI_THRESHOLD     -80     // dBm
+#define LORA_LBT_SENSE_MS           5
+#define LORA_LBT_CW_MIN             2       // slots
+#define LORA_LBT_CW_MAX             64      // slots
+#define LORA_LBT_MAX_ATTEMPTS       7
+#define LORA_LBT_SLOT_MIN_MS        10
+
+struct lora_lbt_stats {
+    u32_t clear;            // carrier sense found the channel free
+    u32_t busy;             // ... and busy
+    u32_t backoffs;
+    u32_t backoff_ms;       // total time spent backing off
+    u32_t dropped;          // frames given up after LORA_LBT_MAX_ATTEMPTS
+};
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+bool  lora_lbt_channel_clear(u32_t frequency);
+u32_t lora_lbt_backoff_ms(u8_t attempt, u32_t airtime_us);
+void  lora_lbt_dropped(void);
+void  lora_lbt_get_stats(struct lora_lbt_stats * stats);
+
+#endif  // __LORA_LBT_H__
@@ -0,0 +1,46 @@
+/*
+ *  lora_power.h
+ */
+#ifndef __LORA_POWER_H__
+#define __LORA_POWER_H__
+
+#include <zephyr/types.h>
+
+/*
+ *   Energy accounting.  The radio thread reports each SX1276 state change;
+ *   time in each state is weighted by typical supply current (SX1276
+ *   datasheet, 3.3V, 125kHz) to estimate the charge drawn.  The sx1276
+ *   driver sleeps the radio after every TX and RX, so time between
+ *   operations counts as sleep.  The MCU adds its System ON idle floor;
+ *   its active time and BLE are not included.
+ */
+#define LORA_POWER_TX_UA            44000   // PA_BOOST, around +14dBm
+#define LORA_POWER_RX_UA            10800   // LnaBoost off
+#define LORA_POWER_STANDBY_UA       1600    // during lora_config
+#define LORA_POWER_SLEEP_UA         1       // 0.2uA typ, rounded up
+#define LORA_POWER_MCU_IDLE_UA      3       // nRF52832 System ON, RTC running
+
+#define LORA_POWER_BATTERY_MAH      2400    // 2 x AA
+
+typedef enum {
+    LORA_POWER__SLEEP = 0,
+    LORA_POWER__STANDBY,
+    LORA_POWER__RX,
+    LORA_POWER__TX,
+    LORA_POWER__STATES
+} lora_power_state_t;
+
+struct lora_power_stats {
+    u64_t time_us[LORA_POWER__STATES];
+    u32_t charge_uah;           // estimated charge drawn since boot
+    u32_t average_ua;           // over the same period
+};
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_power_enter(lora_power_state_t state);
+void lora_power_get_stats(struct lora_power_stats * stats);
+u8_t lora_power_battery_level(void);
+
+#endif  // __LORA_POWER_H__
@@ -0,0 +1,76 @@
+/*
+ *  lora_prof.h
+ */
+#ifndef __LORA_PROF_H__
+#define __LORA_PROF_H__
+
+#include <zephyr/types.h>
+
+/*
+ *   Radio phase profiling.  Each lora_config(), lora_send() and lora_recv()
+ *   is timestamped, and the SX1276 DIO0 interrupt -- TxDone or RxDone --
+ *   splits send and receive into phases:
+ *
+ *     CONFIG     lora_config(): register writes over SPI
+ *     TX_LOAD    lora_send() to TxDone, less the frame's time on air:
+ *                FIFO load over SPI, mode switch and PA ramp
+ *     TX_DONE    TxDone to lora_send() returning: IRQ work item, wakeup,
+ *                IRQ clear and sleep over SPI
+ *     TX_TOTAL   the whole lora_send()
+ *     RX_DONE    RxDone to lora_recv() returning: IRQ work item, FIFO
+ *                read over SPI and wakeup
+ *
+ *   Each phase gets two figures.  Elapsed time comes from the kernel cycle
+ *   counter (the 32768Hz RTC on nRF52, so 30.5us steps): count, min, mean,
+ *   max, and a p99 read from a histogram with four buckets per octave (the
+ *   bucket's upper bound, so at most 25% high).  CPU time comes from the
+ *   Cortex-M DWT cycle counter, one count per 64MHz CPU clock; it stops
+ *   while the CPU sleeps waiting on SPI or the radio, so it is the
+ *   driver's own cost in the phase, and the gap to the elapsed time is
+ *   the bus and the radio.  Without DWT (native_posix) it is not kept and
+ *   the DIO0 phases are not recorded.  The DWT counter runs from
+ *   PRE_KERNEL_1, so other modules can time their init with it too
+ *   (lora_prof_stamp, lora_prof_elapsed_us).
+ */
+#define LORA_PROF_BUCKETS       128     // 4 per octave over 32 bits
+
+typedef enum {
+    LORA_PROF__CONFIG = 0,
+    LORA_PROF__TX_LOAD,
+    LORA_PROF__TX_DONE,
+    LORA_PROF__TX_TOTAL,
+    LORA_PROF__RX_DONE,
+    LORA_PROF__COUNT
+} lora_prof_phase_t;
+
+struct lora_prof_stamp {
+    u32_t cycles;           // k_cycle_get_32()
+    u32_t cpu;              // DWT CYCCNT
+};
+
+struct lora_prof_summary {
+    u32_t count;
+    u32_t min_us;
+    u32_t avg_us;
+    u32_t max_us;
+    u32_t p99_us;
+    u32_t cpu_avg;          // CPU cycles
+    u32_t cpu_max;
+};
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_prof_init(void);
+void lora_prof_stamp(struct lora_prof_stamp * stamp);
+u32_t lora_prof_elapsed_us(const struct lora_prof_stamp * start);
+void lora_prof_arm(void);
+void lora_prof_config(const struct lora_prof_stamp * start);
+void lora_prof_send(const struct lora_prof_stamp * start, u32_t airtime_us);
+void lora_prof_recv(void);
+void lora_prof_get(lora_prof_phase_t phase, struct lora_prof_summary * out);
+const char * lora_prof_name(lora_prof_phase_t phase);
+void lora_prof_dump(void);
+void lora_prof_reset(void);
+
+#endif  // __LORA_PROF_H__
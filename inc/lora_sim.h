@@ -0,0 +1,48 @@
+/*
+ *  lora_sim.h
+ */
+#ifndef __LORA_SIM_H__
+#define __LORA_SIM_H__
+
+#include <zephyr/types.h>
+
+/*---------------------------------------------------------------------------*/
+/*  Simulated SX1276 for native_posix builds.                                */
+/*                                                                           */
+/*  lora_send takes the frame's time on air and hands the frame to an        */
+/*  optional TX tap.  Frames injected with lora_sim_inject cross a lossy     */
+/*  channel and are returned by lora_recv after the configured latency.      */
+/*  Carrier sense finds the channel busy with the configured probability,    */
+/*  standing in for other nodes' traffic.                                    */
+/*---------------------------------------------------------------------------*/
+#define LORA_SIM_AIR_FRAMES     16
+
+struct lora_sim_params {
+    u32_t loss_permille;    // probability an injected frame is lost
+    u32_t latency_us;       // delay from inject to RX done
+    u32_t busy_permille;    // probability carrier sense finds the channel busy
+    s16_t rssi;
+    s8_t  snr;
+};
+
+struct lora_sim_stats {
+    u32_t configs;
+    u32_t tx_frames;
+    u32_t rx_injected;
+    u32_t rx_lost;          // dropped by the loss model
+    u32_t rx_overflow;      // channel queue full
+    u32_t rx_delivered;
+    u32_t cs_checks;        // carrier sense calls
+    u32_t cs_busy;
+};
+
+typedef void (*lora_sim_tap_t)(const u8_t * data, u8_t len);
+
+void lora_sim_set_params(const struct lora_sim_params * params);
+void lora_sim_set_tx_tap(lora_sim_tap_t tap);
+int  lora_sim_inject(const u8_t * data, u8_t len);
+void lora_sim_get_stats(struct lora_sim_stats * stats);
+bool lora_sim_channel_free(u32_t frequency, s16_t rssi_threshold,
+                           u32_t sense_ms);
+
+#endif  // __LORA_SIM_H__
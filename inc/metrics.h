@@ -0,0 +1,81 @@
+/*
+ *  metrics.h
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <zephyr/types.h>
+#include <sys/atomic.h>
+
+/*
+ *   Runtime metrics.  Counters and histograms are arrays of atomic_t, so
+ *   any thread or ISR updates them without a lock: a counter update is one
+ *   atomic add, a histogram update a bucket lookup and three.  Readers take
+ *   a snapshot that may be a few updates apart between fields.
+ *
+ *   Histograms have METRICS_BUCKETS buckets, either linear from "lo" in
+ *   steps of 1 << shift, or logarithmic (bucket n holds values below
+ *   2^(shift + n)).  Values outside the range land in the first or last.
+ */
+#define METRICS_BUCKETS         8
+
+typedef enum {
+    METRIC_LORA_TX_FRAMES = 0,
+    METRIC_LORA_TX_ERRORS,
+    METRIC_LORA_RX_FRAMES,
+    METRIC_LORA_RX_CRC_ERRORS,
+    METRIC_BLE_QUEUE_REFUSED,
+    METRIC_BLE_NOTIFY_FAILED,
+    METRIC_COUNT
+} metric_t;
+
+typedef enum {
+    METRIC_HIST_LORA_RSSI = 0,      // dBm
+    METRIC_HIST_LORA_SNR,           // dB
+    METRIC_HIST_LORA_SEND_US,       // lora_send() duration
+    METRIC_HIST_BLE_QUEUE_DEPTH,    // messages waiting, at each enqueue
+    METRIC_HIST_COUNT
+} metric_hist_t;
+
+struct metrics_hist {
+    atomic_t count;
+    atomic_t sum;
+    atomic_t bucket[METRICS_BUCKETS];
+};
+
+extern atomic_t metrics_counters[METRIC_COUNT];
+
+/*---------------------------------------------------------------------------*/
+/*  Binary export (GATT "Metrics" characteristic), all fields little-endian: */
+/*                                                                           */
+/*  [version][counters][histograms][buckets]                                 */
+/*  counters   x u32                                                         */
+/*  histograms x { u32 count, s32 sum, buckets x u32 }                       */
+/*---------------------------------------------------------------------------*/
+#define METRICS_VERSION         1
+#define METRICS_EXPORT_LEN      (4 + METRIC_COUNT * 4 + \
+                                 METRIC_HIST_COUNT * (8 + METRICS_BUCKETS * 4))
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static inline void metrics_inc(metric_t id)
+{
+    atomic_inc(&metrics_counters[id]);
+}
+
+static inline void metrics_add(metric_t id, u32_t value)
+{
+    atomic_add(&metrics_counters[id], value);
+}
+
+void metrics_observe(metric_hist_t id, s32_t value);
+u32_t metrics_get(metric_t id);
+void metrics_hist_get(metric_hist_t id, struct metrics_hist * hist);
+const char * metrics_name(metric_t id);
+const char * metrics_hist_name(metric_hist_t id);
+s32_t metrics_bucket_bound(metric_hist_t id, u8_t bucket);
+int  metrics_export(u8_t * buf, size_t size);
+void metrics_reset(void);
+
+#endif  // __METRICS_H__
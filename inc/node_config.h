@@ -0,0 +1,79 @@
+/*
+ *  node_config.h
+ */
+#ifndef __NODE_CONFIG_H__
+#define __NODE_CONFIG_H__
+
+#include <zephyr/types.h>
+#include <drivers/lora.h>
+
+#include "lora_adr.h"
+#include "lora_app.h"
+
+/*
+ *   Node configuration: the node's own and default peer LoRa ids, and the
+ *   radio settings it boots with.  It is kept with the settings subsystem
+ *   (NVS in the "storage" flash partition) and read at APPLICATION init,
+ *   before the radio and BLE threads start, so a node comes up on its
+ *   stored settings with nothing to provision.  Without a stored record
+ *   the defaults below apply.  The BLE device name is stored the same way,
+ *   built once from the factory device id on first boot.
+ *
+ *   A new record written over BLE (the "Config" characteristic) is checked,
+ *   saved, and applied by resetting the node NODE_CONFIG_REBOOT_MS later;
+ *   the running configuration never changes under the radio.
+ */
+#define NODE_CONFIG_DEFAULT_NODE_ID     1
+#define NODE_CONFIG_DEFAULT_PEER_ID     2
+#define NODE_CONFIG_DEFAULT_FREQUENCY   LORA_APP_FREQUENCY
+#define NODE_CONFIG_DEFAULT_BANDWIDTH   BW_125_KHZ
+#define NODE_CONFIG_DEFAULT_DATARATE    SF_7
+#define NODE_CONFIG_DEFAULT_TX_POWER    LORA_ADR_POWER_MAX
+
+#define NODE_CONFIG_FREQUENCY_MIN       902000000   // US 902-928MHz band
+#define NODE_CONFIG_FREQUENCY_MAX       928000000
+#define NODE_CONFIG_NAME_LEN            16          // NUL included
+#define NODE_CONFIG_REBOOT_MS           1000
+
+struct node_config {
+    u32_t frequency;        // Hz, when not hopping
+    u8_t  bandwidth;        // enum lora_signal_bandwidth
+    u8_t  datarate;         // enum lora_datarate: ADR's starting point
+    s8_t  tx_power;         // dBm: ADR's ceiling
+    u8_t  node_id;          // this node
+    u8_t  peer_id;          // default destination
+};
+
+/*---------------------------------------------------------------------------*/
+/*  Record, as stored and as read or written over BLE, little-endian:        */
+/*                                                                           */
+/*     0         1         2       3    4      5         6 ... 9             */
+/*  +---------+---------+---------+----+----+----------+-----------+         */
+/*  | version | node_id | peer_id | SF | BW | tx_power | frequency |         */
+/*  +---------+---------+---------+----+----+----------+-----------+         */
+/*                                                                           */
+/*  SF 7-12, BW 0-2 (125, 250, 500kHz), tx_power in dBm (s8).                */
+/*---------------------------------------------------------------------------*/
+#define NODE_CONFIG_VERSION             1
+#define NODE_CONFIG_RECORD_LEN          10
+
+struct node_config_stats {
+    bool  stored;           // booted from a stored record, not defaults
+    u32_t load_us;          // CPU time (DWT) to read the settings at boot
+    u32_t saves;
+    u32_t save_errors;
+};
+
+/* The configuration the node booted with; do not modify */
+extern struct node_config node_config;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int  node_config_export(u8_t * buf, u16_t size);
+int  node_config_import(const u8_t * buf, u16_t len);
+const char * node_config_name(void);
+int  node_config_set_name(const char * name);
+void node_config_get_stats(struct node_config_stats * stats);
+
+#endif  // __NODE_CONFIG_H__
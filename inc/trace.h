@@ -0,0 +1,98 @@
+/*
+ *  trace.h
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <zephyr/types.h>
+
+/*
+ *   Binary packet trace.  Per-packet events go into a ring of fixed-size
+ *   records, written without any formatting; a work item drains the ring
+ *   every TRACE_FLUSH_MS to RTT up-channel TRACE_RTT_CHANNEL, in skip mode
+ *   so a slow or absent host never blocks the target.  Records that find
+ *   the ring full are counted and dropped.  scripts/trace_decode.py turns
+ *   the channel dump back into text.  Without RTT (native_posix) records
+ *   are only counted.
+ *
+ *   Each event has a level; only events at or below the runtime level
+ *   (trace_set_level(), "trace level" in the shell) are recorded.
+ */
+#define TRACE_RECORDS           64      // power of two
+#define TRACE_FLUSH_MS          100
+#define TRACE_RTT_CHANNEL       1
+#define TRACE_RTT_BUFFER_SIZE   512
+
+typedef enum {
+    TRACE_LEVEL__OFF = 0,
+    TRACE_LEVEL__ERROR,         // failed sends, CRC errors, LBT drops
+    TRACE_LEVEL__PACKET,        // plus every frame sent or received
+    TRACE_LEVEL__ALL,           // plus radio reconfigurations and sleeps
+} trace_level_t;
+
+#define TRACE_LEVEL_DEFAULT     TRACE_LEVEL__PACKET
+
+/* Keep in step with EVENTS in scripts/trace_decode.py */
+typedef enum {
+    TRACE_EV__RX = 1,           // src seq len rssi snr
+    TRACE_EV__RX_BAD,           // len rssi snr
+    TRACE_EV__RX_DUP,           // src seq len rssi snr
+    TRACE_EV__TX,               // dst seq len
+    TRACE_EV__TX_ERROR,         // dst seq len
+    TRACE_EV__TX_BUSY,          // dst seq len: dropped by LBT
+    TRACE_EV__ACK,              // src seq (newest acknowledged) rssi snr
+    TRACE_EV__RECONFIG,         // len = SF, rssi = TX power
+    TRACE_EV__RETUNE,           // len = hop channel
+    TRACE_EV__SLEEP,
+    TRACE_EV__WAKE,
+} trace_event_t;
+
+/*---------------------------------------------------------------------------*/
+/*  Record, 12 bytes little-endian:                                          */
+/*                                                                           */
+/*     0 ... 3     4      5      6      7     8 ... 9   10     11            */
+/*  +-----------+-------+-----+-----+-----+---------+-----+--------+         */
+/*  | time (us) | event | src | seq | len |  rssi   | snr | serial |         */
+/*  +-----------+-------+-----+-----+-----+---------+-----+--------+         */
+/*                                                                           */
+/*  "serial" counts records written, so the host sees gaps from drops.       */
+/*---------------------------------------------------------------------------*/
+struct trace_record {
+    u32_t time_us;
+    u8_t  event;
+    u8_t  src;
+    u8_t  seq;
+    u8_t  len;
+    s16_t rssi;
+    s8_t  snr;
+    u8_t  serial;
+} __attribute__((__packed__));
+
+struct trace_stats {
+    u32_t written;
+    u32_t dropped;              // ring full
+    u32_t flushed;              // records handed to the host
+};
+
+extern u8_t trace_level;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void trace_write(trace_event_t event, u8_t src, u8_t seq, u8_t len,
+                 s16_t rssi, s8_t snr);
+
+static inline void trace_event(trace_level_t level, trace_event_t event,
+                               u8_t src, u8_t seq, u8_t len,
+                               s16_t rssi, s8_t snr)
+{
+    if (level <= trace_level) {
+        trace_write(event, src, seq, len, rssi, snr);
+    }
+}
+
+void trace_set_level(trace_level_t level);
+void trace_flush(void);
+void trace_get_stats(struct trace_stats * stats);
+
+#endif  // __TRACE_H__
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+#
+#  Copyright (c) 2020  Callender-Consulting
+#
+#  SPDX-License-Identifier: Apache-2.0
+#
+"""Decode the binary packet trace (inc/trace.h) captured from RTT channel 1.
+
+Capture with, for example:
+
+    JLinkRTTLogger -Device NRF52832_XXAA -If SWD -Speed 4000 \\
+                   -RTTChannel 1 trace.bin
+
+then run "scripts/trace_decode.py trace.bin".  Gaps in the record serial
+number are reported as records dropped on the target.
+"""
+
+import argparse
+import struct
+import sys
+
+RECORD = struct.Struct("<IBBBBhbB")     # struct trace_record
+
+# Keep in step with trace_event_t in inc/trace.h
+EVENTS = {
+    1:  "RX",
+    2:  "RX_BAD",
+    3:  "RX_DUP",
+    4:  "TX",
+    5:  "TX_ERROR",
+    6:  "TX_BUSY",
+    7:  "ACK",
+    8:  "RECONFIG",
+    9:  "RETUNE",
+    10: "SLEEP",
+    11: "WAKE",
+}
+
+
+def describe(event, src, seq, length, rssi, snr):
+    name = EVENTS.get(event, "EV%u" % event)
+
+    if name in ("RX", "RX_DUP", "ACK"):
+        return "%-8s src=%u seq=%u len=%u rssi=%d snr=%d" % (
+            name, src, seq, length, rssi, snr)
+    if name == "RX_BAD":
+        return "%-8s len=%u rssi=%d snr=%d" % (name, length, rssi, snr)
+    if name in ("TX", "TX_ERROR", "TX_BUSY"):
+        return "%-8s dst=%u seq=%u len=%u" % (name, src, seq, length)
+    if name == "RECONFIG":
+        return "%-8s sf=%u power=%ddBm" % (name, length, rssi)
+    if name == "RETUNE":
+        return "%-8s channel=%u" % (name, length)
+    return name
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file", nargs="?", help="trace dump (default stdin)")
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file, "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    expected = None
+    dropped = 0
+    count = 0
+
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        time_us, event, src, seq, length, rssi, snr, serial = \
+            RECORD.unpack_from(data, offset)
+
+        if expected is not None and serial != expected:
+            gap = (serial - expected) & 0xFF
+            dropped += gap
+            print("%12s %u records dropped" % ("", gap))
+        expected = (serial + 1) & 0xFF
+
+        print("%8u.%03u %s" % (time_us // 1000, time_us % 1000,
+                               describe(event, src, seq, length, rssi, snr)))
+        count += 1
+
+    print("%u records, at least %u dropped" % (count, dropped),
+          file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
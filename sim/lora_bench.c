@@ -0,0 +1,632 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ *  Host benchmark harness for native_posix.
+ *
+ *  Drives the TX, RX and BLE command paths against the simulated SX1276
+ *  and prints one "BENCH" line per path: frames/sec in simulated time,
+ *  per-frame latency percentiles, and host CPU time per frame.
+ */
+#include <errno.h>
+#include <random/rand32.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/byteorder.h>
+#include <sys/printk.h>
+#include <zephyr.h>
+
+#include "posix_board_if.h"
+
+#include "bench.h"
+#include "lora_app.h"
+#include "lora_codec.h"
+#include "lora_frag.h"
+#include "lora_frame.h"
+#include "lora_lbt.h"
+#include "lora_power.h"
+#include "lora_prof.h"
+#include "lora_sim.h"
+#include "trace.h"
+
+#ifdef CONFIG_BT
+#include "ble_policy.h"
+#endif
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_bench);
+
+#define BENCH_FRAMES        200
+#define BENCH_PAYLOAD_LEN   16
+#define BENCH_NODE_ID       1       // NODE_CONFIG_DEFAULT_NODE_ID
+#define BENCH_PEER_ID       2
+#define BENCH_TIMEOUT_MS    (3600 * MSEC_PER_SEC)
+
+static u32_t stamp[BENCH_FRAMES];       // k_cycle_get_32() at submit
+static u32_t latency[BENCH_FRAMES];     // microseconds, or ns for BLE
+static volatile u32_t tx_seen;
+
+static u8_t peer_seq;
+
+/* Simulated peer's duplicate filter, for its selective ACKs */
+static struct lora_frame_dedup arq_peer;
+
+/* Fragmentation: the message sent, and the first fragment held back */
+static u8_t  frag_msg[LORA_FRAG_MAX_LEN];
+static u8_t  frag_held[LORA_FRAME_MAX_LEN];
+static u8_t  frag_held_len;
+static volatile bool frag_match;
+static volatile u32_t frag_received;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int cmp_u32(const void * a, const void * b)
+{
+    u32_t x = *(const u32_t *)a;
+    u32_t y = *(const u32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Print one result line; sorts "samples" in place.                         */
+/*---------------------------------------------------------------------------*/
+static void bench_report(const char * path, u32_t * samples, u32_t count,
+                         s64_t sim_ms, u64_t cpu_ns, const char * unit)
+{
+    u32_t mfps = 0;
+
+    if (count == 0) {
+        printk("BENCH %s no samples\n", path);
+        return;
+    }
+
+    qsort(samples, count, sizeof(u32_t), cmp_u32);
+
+    if (sim_ms > 0) {
+        mfps = (u32_t)(((u64_t)count * MSEC_PER_SEC * 1000) / sim_ms);
+    }
+
+    printk("BENCH %s frames=%u fps=%u.%03u p50=%u%s p90=%u%s p99=%u%s "
+           "max=%u%s cpu=%uns/frame\n",
+           path, count, mfps / 1000, mfps % 1000,
+           samples[count / 2], unit,
+           samples[(count * 90) / 100], unit,
+           samples[(count * 99) / 100], unit,
+           samples[count - 1], unit,
+           (u32_t)(cpu_ns / count));
+}
+
+/*---------------------------------------------------------------------------*/
+/*  A frame from the simulated peer, carrying "index" in its payload.        */
+/*---------------------------------------------------------------------------*/
+static int bench_inject(u32_t index)
+{
+    struct lora_frame_hdr hdr = {
+        .dst   = BENCH_NODE_ID,
+        .src   = BENCH_PEER_ID,
+        .seq   = peer_seq,
+        .flags = 0,
+        .len   = BENCH_PAYLOAD_LEN,
+        .slot  = LORA_FRAME_SLOT_NONE,
+    };
+    u8_t buf[LORA_FRAME_OVERHEAD + BENCH_PAYLOAD_LEN];
+    int  len;
+    int  ret;
+
+    memset(LORA_FRAME_PAYLOAD(buf), 0, BENCH_PAYLOAD_LEN);
+    sys_put_le32(index, LORA_FRAME_PAYLOAD(buf));
+
+    len = lora_frame_encode(buf, sizeof(buf), &hdr);
+
+    ret = lora_sim_inject(buf, len);
+    if (ret == 0) {
+        peer_seq++;
+    }
+    return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  TX tap: runs on the radio thread at TX done.                             */
+/*---------------------------------------------------------------------------*/
+static void bench_tx_tap(const u8_t * data, u8_t len)
+{
+    struct lora_frame_hdr hdr;
+    u32_t index;
+
+    if (lora_frame_decode(data, len, &hdr) < 0 || hdr.len < sizeof(u32_t)) {
+        return;
+    }
+
+    /* Anything else on air (e.g. the beacon) decodes to an out-of-range index */
+    index = sys_get_le32(LORA_FRAME_PAYLOAD(data));
+    if (index >= BENCH_FRAMES) {
+        return;
+    }
+
+    latency[index] = k_cyc_to_us_floor32(k_cycle_get_32() - stamp[index]);
+    tx_seen++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  TX: submit "count" frames as fast as the queue takes them; latency is    */
+/*  submit to TX done.  The peer keeps talking so ADR holds the link.        */
+/*  Frames dropped by LBT end the run early.                                 */
+/*---------------------------------------------------------------------------*/
+static void bench_tx_run(const char * path, u32_t count)
+{
+    struct lora_lbt_stats lbt;
+    lora_rx_frame_t * frame;
+    u8_t  payload[BENCH_PAYLOAD_LEN] = { 0 };
+    s64_t start;
+    u64_t cpu;
+    u32_t dropped;
+    u32_t i;
+
+    tx_seen = 0;
+    lora_sim_set_tx_tap(bench_tx_tap);
+
+    lora_lbt_get_stats(&lbt);
+    dropped = lbt.dropped;
+
+    start = k_uptime_get();
+    cpu   = bench_now_ns();
+
+    for (i = 0; i < count; i++) {
+        sys_put_le32(i, payload);
+        stamp[i] = k_cycle_get_32();
+        lora_app_enqueue(BENCH_PEER_ID, payload, sizeof(payload), K_FOREVER);
+    }
+
+    while (tx_seen + lbt.dropped - dropped < count &&
+           k_uptime_get() - start < BENCH_TIMEOUT_MS) {
+        bench_inject(UINT32_MAX);
+        k_sleep(MSEC_PER_SEC);
+
+        while ((frame = lora_app_rx_get(K_NO_WAIT)) != NULL) {
+            lora_app_rx_release(frame);
+        }
+
+        lora_lbt_get_stats(&lbt);
+    }
+
+    bench_report(path, latency, tx_seen, k_uptime_get() - start,
+                 bench_now_ns() - cpu, "us");
+
+    lora_sim_set_tx_tap(NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void bench_tx(void)
+{
+    bench_tx_run("tx", BENCH_FRAMES);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  LBT: TX again with carrier sense finding the channel busy 30% of the     */
+/*  time, as with about 20 nodes each sending a 50ms frame every 3s.         */
+/*---------------------------------------------------------------------------*/
+static void bench_lbt(void)
+{
+    struct lora_sim_params params = {
+        .rssi          = -60,
+        .snr           = 8,
+        .busy_permille = 300,
+    };
+    struct lora_lbt_stats lbt;
+
+    lora_sim_set_params(&params);
+
+    bench_tx_run("tx-lbt", BENCH_FRAMES / 4);
+
+    params.busy_permille = 0;
+    lora_sim_set_params(&params);
+
+    lora_lbt_get_stats(&lbt);
+    printk("BENCH lbt clear=%u busy=%u backoffs=%u backoff=%ums dropped=%u\n",
+           lbt.clear, lbt.busy, lbt.backoffs, lbt.backoff_ms, lbt.dropped);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  RX: inject BENCH_FRAMES from the peer and consume them; latency is       */
+/*  inject to lora_app_rx_get.                                               */
+/*---------------------------------------------------------------------------*/
+static void bench_rx(void)
+{
+    lora_rx_frame_t * frame;
+    s64_t start;
+    u64_t cpu;
+    u32_t sent = 0;
+    u32_t got  = 0;
+    u32_t index;
+
+    start = k_uptime_get();
+    cpu   = bench_now_ns();
+
+    while (got < BENCH_FRAMES && k_uptime_get() - start < BENCH_TIMEOUT_MS) {
+
+        if (sent < BENCH_FRAMES) {
+            stamp[sent] = k_cycle_get_32();
+            if (bench_inject(sent) == 0) {
+                sent++;
+                continue;
+            }
+        }
+
+        frame = lora_app_rx_get(K_MSEC(10));
+        if (!frame) {
+            continue;
+        }
+
+        index = sys_get_le32(LORA_FRAME_PAYLOAD(frame->data));
+        if (index < BENCH_FRAMES) {
+            latency[got++] = k_cyc_to_us_floor32(k_cycle_get_32() - stamp[index]);
+        }
+        lora_app_rx_release(frame);
+    }
+
+    bench_report("rx", latency, got, k_uptime_get() - start,
+                 bench_now_ns() - cpu, "us");
+}
+
+/*---------------------------------------------------------------------------*/
+/*  ARQ tap: the simulated peer loses 10% of data frames and answers each    */
+/*  poll with a selective ACK, which crosses the lossy channel back.         */
+/*---------------------------------------------------------------------------*/
+static void bench_arq_tap(const u8_t * data, u8_t len)
+{
+    struct lora_frame_hdr hdr;
+    struct lora_frame_hdr ack = {
+        .dst   = BENCH_NODE_ID,
+        .src   = BENCH_PEER_ID,
+        .seq   = 0,
+        .flags = LORA_FRAME_FLAG_ACK,
+        .len   = LORA_FRAME_SACK_LEN,
+        .slot  = LORA_FRAME_SLOT_NONE,
+    };
+    u8_t  buf[LORA_FRAME_OVERHEAD + LORA_FRAME_SACK_LEN];
+    u8_t  last_seq;
+    u32_t window;
+
+    if (lora_frame_decode(data, len, &hdr) < 0 || hdr.dst != BENCH_PEER_ID ||
+        (hdr.flags & LORA_FRAME_FLAG_ACK)) {
+        return;
+    }
+
+    if ((sys_rand32_get() % 1000) < 100) {
+        return;
+    }
+
+    lora_frame_accept(&arq_peer, &hdr, BENCH_PEER_ID, k_uptime_get_32());
+
+    if (!(hdr.flags & LORA_FRAME_FLAG_POLL) ||
+        lora_frame_sack_get(&arq_peer, BENCH_NODE_ID, &last_seq, &window) < 0) {
+        return;
+    }
+
+    LORA_FRAME_PAYLOAD(buf)[0] = last_seq;
+    sys_put_le32(window, LORA_FRAME_PAYLOAD(buf) + 1);
+
+    lora_sim_inject(buf, lora_frame_encode(buf, sizeof(buf), &ack));
+}
+
+/*---------------------------------------------------------------------------*/
+/*  ARQ: reliable mode over 10% loss each way; reports how many frames got   */
+/*  through and what it cost on air.                                         */
+/*---------------------------------------------------------------------------*/
+static void bench_arq(void)
+{
+    struct lora_sim_params params = {
+        .loss_permille = 100,
+        .rssi          = -60,
+        .snr           = 8,
+    };
+    struct lora_app_stats before;
+    struct lora_app_stats after;
+    u8_t  payload[BENCH_PAYLOAD_LEN] = { 0 };
+    u32_t count = BENCH_FRAMES / 4;
+    s64_t start;
+    u32_t done;
+    u32_t i;
+
+    memset(&arq_peer, 0, sizeof(arq_peer));
+
+    lora_sim_set_params(&params);
+    lora_sim_set_tx_tap(bench_arq_tap);
+    lora_app_set_reliable(true);
+
+    lora_app_get_stats(&before);
+    start = k_uptime_get();
+
+    for (i = 0; i < count; i++) {
+        sys_put_le32(i, payload);
+        lora_app_enqueue(BENCH_PEER_ID, payload, sizeof(payload), K_FOREVER);
+    }
+
+    do {
+        k_sleep(100);
+        lora_app_get_stats(&after);
+        done = (after.arq_acked + after.arq_failed) -
+               (before.arq_acked + before.arq_failed);
+    } while (done < count && k_uptime_get() - start < BENCH_TIMEOUT_MS);
+
+    lora_app_set_reliable(false);
+    lora_sim_set_tx_tap(NULL);
+
+    params.loss_permille = 0;
+    lora_sim_set_params(&params);
+
+    printk("BENCH arq frames=%u acked=%u failed=%u resent=%u timeouts=%u "
+           "air=%uB goodput=%uB sim=%ums\n", count,
+           after.arq_acked - before.arq_acked,
+           after.arq_failed - before.arq_failed,
+           after.arq_retransmissions - before.arq_retransmissions,
+           after.arq_timeouts - before.arq_timeouts,
+           after.tx_bytes - before.tx_bytes,
+           after.goodput_bytes - before.goodput_bytes,
+           (u32_t)(k_uptime_get() - start));
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Fragment tap: the peer echoes each fragment back as its own, holding     */
+/*  the first one back until after the last so reassembly sees them out of   */
+/*  order.                                                                   */
+/*---------------------------------------------------------------------------*/
+static void bench_frag_echo(const u8_t * data, u8_t len)
+{
+    struct lora_frame_hdr hdr;
+    u8_t buf[LORA_FRAME_MAX_LEN];
+
+    lora_frame_decode(data, len, &hdr);
+
+    hdr.dst = BENCH_NODE_ID;
+    hdr.src = BENCH_PEER_ID;
+    hdr.seq = peer_seq++;
+
+    memcpy(LORA_FRAME_PAYLOAD(buf), LORA_FRAME_PAYLOAD(data), hdr.len);
+    lora_sim_inject(buf, lora_frame_encode(buf, sizeof(buf), &hdr));
+}
+
+static void bench_frag_tap(const u8_t * data, u8_t len)
+{
+    struct lora_frame_hdr hdr;
+    const u8_t * fragment = LORA_FRAME_PAYLOAD(data);
+    u8_t plain[LORA_FRAME_MAX_PAYLOAD];
+
+    if (lora_frame_decode(data, len, &hdr) < 0 || hdr.dst != BENCH_PEER_ID ||
+        !(hdr.flags & LORA_FRAME_FLAG_FRAG)) {
+        return;
+    }
+
+    /* The fragment header may itself be coded */
+    if (hdr.flags & LORA_FRAME_FLAG_CODEC) {
+        if (lora_codec_expand(fragment, hdr.len, plain, sizeof(plain)) < 0) {
+            return;
+        }
+        fragment = plain;
+    }
+
+    if (fragment[1] == 0 && fragment[2] > 1) {
+        memcpy(frag_held, data, len);
+        frag_held_len = len;
+        return;
+    }
+
+    bench_frag_echo(data, len);
+
+    if (fragment[1] == fragment[2] - 1 && frag_held_len) {
+        bench_frag_echo(frag_held, frag_held_len);
+        frag_held_len = 0;
+    }
+}
+
+static void bench_frag_rx(u8_t src, const u8_t * msg, u16_t len)
+{
+    frag_match = (len == sizeof(frag_msg) &&
+                  memcmp(msg, frag_msg, sizeof(frag_msg)) == 0);
+    frag_received++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Fragmentation: a LORA_FRAG_MAX_LEN message out and, via the peer's       */
+/*  echo, back in; reports the fragment size, time on air and whether the    */
+/*  reassembled copy matches.                                                */
+/*---------------------------------------------------------------------------*/
+static void bench_frag(void)
+{
+    struct lora_frag_stats frag;
+    struct lora_app_stats before;
+    struct lora_app_stats after;
+    s64_t start;
+    u32_t i;
+
+    for (i = 0; i < sizeof(frag_msg); i++) {
+        frag_msg[i] = i * 7 + (i >> 8);
+    }
+
+    frag_received = 0;
+    lora_sim_set_tx_tap(bench_frag_tap);
+    lora_frag_set_rx_callback(bench_frag_rx);
+
+    lora_app_get_stats(&before);
+    start = k_uptime_get();
+
+    lora_frag_send(BENCH_PEER_ID, frag_msg, sizeof(frag_msg), K_FOREVER);
+
+    while (!frag_received && k_uptime_get() - start < BENCH_TIMEOUT_MS) {
+        k_sleep(100);
+    }
+
+    lora_sim_set_tx_tap(NULL);
+    lora_frag_set_rx_callback(NULL);
+
+    lora_app_get_stats(&after);
+    lora_frag_get_stats(&frag);
+
+    printk("BENCH frag len=%u size=%u fragments=%u air=%ums match=%s "
+           "dropped=%u sim=%ums\n", (u32_t)sizeof(frag_msg),
+           lora_frag_size(sizeof(frag_msg)), frag.tx_fragments,
+           after.tx_airtime_ms - before.tx_airtime_ms,
+           frag_match ? "yes" : "no", frag.rx_dropped,
+           (u32_t)(k_uptime_get() - start));
+}
+
+#ifdef CONFIG_BT
+/*---------------------------------------------------------------------------*/
+/*  BLE: one VOICE command through enqueue, dispatch and completion.         */
+/*  The path is synchronous here, so latency is CPU time (ns).               */
+/*---------------------------------------------------------------------------*/
+static void bench_ble(void)
+{
+    u64_t cpu = bench_now_ns();
+    u64_t t0;
+    u32_t i;
+
+    for (i = 0; i < BENCH_FRAMES; i++) {
+        t0 = bench_now_ns();
+        ble_enqueue_msg(BLE_EVENT__VOICE, (BLE_CMD__LEFT << 24) | i);
+        ble_queue_drain();
+        latency[i] = (u32_t)(bench_now_ns() - t0);
+    }
+
+    bench_report("ble", latency, BENCH_FRAMES, 0, bench_now_ns() - cpu, "ns");
+}
+
+/*---------------------------------------------------------------------------*/
+/*  BLE batch: one full VOICE write (BLE_CMD_BATCH_MAX commands) per sample; */
+/*  latency is per write, the cpu figure per command.                        */
+/*---------------------------------------------------------------------------*/
+static void bench_ble_batch(void)
+{
+    struct ble_queue_stats queue;
+    u8_t  buf[BLE_CMD_BATCH_MAX * sizeof(u32_t)];
+    u64_t cpu;
+    u64_t t0;
+    u32_t i;
+
+    for (i = 0; i < BLE_CMD_BATCH_MAX; i++) {
+        sys_put_le32((BLE_CMD__LEFT << 24) | i, &buf[i * sizeof(u32_t)]);
+    }
+
+    cpu = bench_now_ns();
+
+    for (i = 0; i < BENCH_FRAMES; i++) {
+        t0 = bench_now_ns();
+        ble_enqueue_batch(BLE_EVENT__VOICE, buf, BLE_CMD_BATCH_MAX);
+        ble_queue_drain();
+        latency[i] = (u32_t)(bench_now_ns() - t0);
+    }
+
+    bench_report("ble-batch", latency, BENCH_FRAMES, 0,
+                 (bench_now_ns() - cpu) / BLE_CMD_BATCH_MAX, "ns");
+
+    ble_queue_get_stats(&queue);
+    printk("BENCH ble-queue enqueued=%u urgent=%u refused=%u high_water=%u\n",
+           queue.enqueued, queue.urgent, queue.refused, queue.high_water);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*  Low power: one frame every 5s for a minute; reports how late the radio   */
+/*  thread woke, both from its sleep timer and from an enqueue.              */
+/*---------------------------------------------------------------------------*/
+static void bench_power(void)
+{
+    struct lora_app_stats app;
+    u8_t  payload[BENCH_PAYLOAD_LEN] = { 0 };
+    u32_t sleeps;
+    u32_t i;
+
+    lora_app_set_power_mode(LORA_APP_POWER__LOW);
+
+    lora_app_get_stats(&app);
+    sleeps = app.sleeps;
+
+    for (i = 0; i < 12; i++) {
+        sys_put_le32(UINT32_MAX, payload);
+        lora_app_enqueue(BENCH_PEER_ID, payload, sizeof(payload), K_FOREVER);
+        k_sleep(5 * MSEC_PER_SEC);
+    }
+
+    lora_app_set_power_mode(LORA_APP_POWER__ALWAYS_ON);
+
+    lora_app_get_stats(&app);
+    printk("BENCH sleep sleeps=%u early=%u wake_last=%uus wake_max=%uus\n",
+           app.sleeps - sleeps, app.sleep_wakes_early,
+           app.wake_latency_last_us, app.wake_latency_max_us);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void bench_thread(void * id, void * unused1, void * unused2)
+{
+    struct lora_app_stats app;
+    struct lora_codec_stats codec;
+    struct lora_sim_stats sim;
+    struct lora_power_stats power;
+    struct lora_prof_summary config;
+    struct lora_prof_summary send;
+    struct trace_stats trace;
+
+    lora_frame_bench(100000);
+    lora_codec_bench(100000);
+
+    /* Throughput runs keep the radio listening; bench_power() sleeps it */
+    lora_app_set_power_mode(LORA_APP_POWER__ALWAYS_ON);
+
+    bench_rx();
+    bench_tx();
+    bench_lbt();
+    bench_arq();
+    bench_frag();
+
+#ifdef CONFIG_BT
+    bench_ble();
+    bench_ble_batch();
+#endif
+
+    bench_power();
+
+    lora_app_get_stats(&app);
+    lora_sim_get_stats(&sim);
+
+    printk("BENCH radio turnarounds=%u turnaround_max=%uus reconfigs=%u "
+           "airtime=%ums rx_dropped=%u\n",
+           app.turnarounds, app.turnaround_max_us, app.reconfigs,
+           app.tx_airtime_ms, app.rx_pool_empty + app.rx_bad_frames);
+    lora_power_get_stats(&power);
+    printk("BENCH power tx=%ums rx=%ums sleep=%ums avg=%uuA charge=%uuAh\n",
+           (u32_t)(power.time_us[LORA_POWER__TX] / USEC_PER_MSEC),
+           (u32_t)(power.time_us[LORA_POWER__RX] / USEC_PER_MSEC),
+           (u32_t)(power.time_us[LORA_POWER__SLEEP] / USEC_PER_MSEC),
+           power.average_ua, power.charge_uah);
+    lora_codec_get_stats(&codec);
+    printk("BENCH codec frames=%u compressed=%u in=%uB out=%uB "
+           "encode=%ucyc decode=%ucyc\n", codec.frames, codec.compressed,
+           codec.bytes_in, codec.bytes_out, codec.encode_cycles,
+           codec.decode_cycles);
+    trace_get_stats(&trace);
+    printk("BENCH trace written=%u dropped=%u flushed=%u\n", trace.written,
+           trace.dropped, trace.flushed);
+    lora_prof_get(LORA_PROF__CONFIG, &config);
+    lora_prof_get(LORA_PROF__TX_TOTAL, &send);
+    printk("BENCH prof config=%u/%u/%uus send=%u/%u/%uus (avg/p99/max)\n",
+           config.avg_us, config.p99_us, config.max_us,
+           send.avg_us, send.p99_us, send.max_us);
+    printk("BENCH sim configs=%u tx=%u injected=%u lost=%u delivered=%u\n",
+           sim.configs, sim.tx_frames, sim.rx_injected, sim.rx_lost,
+           sim.rx_delivered);
+
+    posix_exit(0);
+}
+
+K_THREAD_DEFINE(bench_id, 2048, bench_thread,
+                NULL, NULL, NULL, 8, 0, 1000);
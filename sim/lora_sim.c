@@ -0,0 +1,208 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <device.h>
+#include <drivers/lora.h>
+#include <errno.h>
+#include <string.h>
+#include <random/rand32.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "lora_sim.h"
+#include "lora_airtime.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_sim);
+
+/*---------------------------------------------------------------------------*/
+/*  The "air": frames in flight toward this node.                            */
+/*---------------------------------------------------------------------------*/
+struct sim_frame {
+    u32_t deliver_at;   // k_cycle_get_32() at RX done
+    s16_t rssi;
+    s8_t  snr;
+    u8_t  len;
+    u8_t  data[255];
+};
+
+K_MSGQ_DEFINE(sim_air, sizeof(struct sim_frame), LORA_SIM_AIR_FRAMES, 4);
+
+static struct lora_modem_config sim_config;
+
+static struct lora_sim_params params = {
+    .loss_permille = 0,
+    .latency_us    = 0,
+    .busy_permille = 0,
+    .rssi          = -60,
+    .snr           = 8,
+};
+
+static struct lora_sim_stats stats;
+
+static lora_sim_tap_t tx_tap;
+
+/* Only the radio thread receives, so one buffer suffices */
+static struct sim_frame rx_frame;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void sim_sleep_us(u32_t us)
+{
+    if (us) {
+        k_sleep(K_MSEC((us + USEC_PER_MSEC - 1) / USEC_PER_MSEC));
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  lora_driver_api                                                          */
+/*---------------------------------------------------------------------------*/
+static int lora_sim_config(struct device * dev, struct lora_modem_config * config)
+{
+    sim_config = *config;
+    stats.configs++;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Blocks for the frame's time on air, as the real driver does while        */
+/*  waiting for TX done.                                                     */
+/*---------------------------------------------------------------------------*/
+static int lora_sim_send(struct device * dev, u8_t * data, u32_t data_len)
+{
+    if (data_len == 0 || data_len > sizeof(rx_frame.data)) {
+        return -EINVAL;
+    }
+
+    sim_sleep_us(lora_airtime_us(&sim_config, data_len));
+
+    stats.tx_frames++;
+
+    if (tx_tap) {
+        tx_tap(data, data_len);
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Constant-latency channel: a frame arrives no earlier than its delivery   */
+/*  time, which may run past "timeout" by up to the configured latency.      */
+/*---------------------------------------------------------------------------*/
+static int lora_sim_recv(struct device * dev, u8_t * data, u8_t size,
+                         s32_t timeout, s16_t * rssi, s8_t * snr)
+{
+    s32_t remaining;
+
+    if (k_msgq_get(&sim_air, &rx_frame, timeout) != 0) {
+        return -EAGAIN;
+    }
+
+    remaining = (s32_t)(rx_frame.deliver_at - k_cycle_get_32());
+    if (remaining > 0) {
+        sim_sleep_us(k_cyc_to_us_floor32(remaining));
+    }
+
+    stats.rx_delivered++;
+
+    if (rx_frame.len > size) {
+        rx_frame.len = size;
+    }
+    memcpy(data, rx_frame.data, rx_frame.len);
+
+    if (rssi) {
+        *rssi = rx_frame.rssi;
+    }
+    if (snr) {
+        *snr = rx_frame.snr;
+    }
+    return rx_frame.len;
+}
+
+static const struct lora_driver_api lora_sim_api = {
+    .config = lora_sim_config,
+    .send   = lora_sim_send,
+    .recv   = lora_sim_recv,
+};
+
+/*---------------------------------------------------------------------------*/
+/*  Simulation controls                                                      */
+/*---------------------------------------------------------------------------*/
+void lora_sim_set_params(const struct lora_sim_params * p)
+{
+    params = *p;
+}
+
+void lora_sim_set_tx_tap(lora_sim_tap_t tap)
+{
+    tx_tap = tap;
+}
+
+void lora_sim_get_stats(struct lora_sim_stats * out)
+{
+    *out = stats;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Carrier sense, as SX1276IsChannelFree: takes "sense_ms" either way.      */
+/*---------------------------------------------------------------------------*/
+bool lora_sim_channel_free(u32_t frequency, s16_t rssi_threshold,
+                           u32_t sense_ms)
+{
+    stats.cs_checks++;
+
+    sim_sleep_us(sense_ms * USEC_PER_MSEC);
+
+    if (params.busy_permille &&
+        (sys_rand32_get() % 1000) < params.busy_permille) {
+        stats.cs_busy++;
+        return false;
+    }
+    return true;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Put a frame on the air toward this node.  Returns -ENOMEM when the       */
+/*  channel is full; a frame lost to the loss model still returns 0.         */
+/*---------------------------------------------------------------------------*/
+int lora_sim_inject(const u8_t * data, u8_t len)
+{
+    struct sim_frame frame;
+
+    stats.rx_injected++;
+
+    if (params.loss_permille &&
+        (sys_rand32_get() % 1000) < params.loss_permille) {
+        stats.rx_lost++;
+        return 0;
+    }
+
+    frame.deliver_at = k_cycle_get_32() + k_us_to_cyc_ceil32(params.latency_us);
+    frame.rssi = params.rssi;
+    frame.snr  = params.snr;
+    frame.len  = len;
+    memcpy(frame.data, data, len);
+
+    if (k_msgq_put(&sim_air, &frame, K_NO_WAIT) != 0) {
+        stats.rx_overflow++;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int lora_sim_init(struct device * dev)
+{
+    LOG_INF("Simulated SX1276 ready");
+    return 0;
+}
+
+DEVICE_AND_API_INIT(lora_sim, DT_INST_0_SEMTECH_SX1276_LABEL, lora_sim_init,
+                    NULL, NULL, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEVICE,
+                    &lora_sim_api);
@@ -18,6 +18,7 @@
 
 #include "ble_policy.h"
 #include "ble_base.h"
+#include "lora_power.h"
 
 #define LOG_LEVEL 3 //CONFIG_LOG_DEFAULT_LEVEL
 #include <logging/log.h>
@@ -25,6 +26,11 @@ LOG_MODULE_REGISTER(ble_base);
 
 static bool connect_state = false;
 
+/* Battery level (simulation) is notified at this period while connected */
+#define BAS_PERIOD_MS   MSEC_PER_SEC
+
+static struct k_delayed_work bas_work;
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
@@ -49,6 +55,8 @@ static void connected_cb(struct bt_conn * conn, u8_t err)
         printk("Connected\n");
 
         connect_state = true;
+
+        k_delayed_work_submit(&bas_work, BAS_PERIOD_MS);
     }
 }
 
@@ -59,6 +67,8 @@ static void disconnected_cb(struct bt_conn * conn, u8_t reason)
 {
     LOG_INF("Disconnected: reason %u", reason);
 
+    k_delayed_work_cancel(&bas_work);
+
     if (default_conn) {
         bt_conn_unref(default_conn);
         default_conn = NULL;
@@ -83,6 +93,17 @@ bool ble_is_connected(void)
     return connect_state;
 }
 
+/*---------------------------------------------------------------------------*/
+/*  ATT MTU of the current connection; the LE default when not connected.    */
+/*---------------------------------------------------------------------------*/
+u16_t ble_get_mtu(void)
+{
+    if (!default_conn) {
+        return 23;  // BT_ATT_DEFAULT_LE_MTU
+    }
+    return bt_gatt_get_mtu(default_conn);
+}
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
@@ -115,6 +136,8 @@ static void bt_ready(int err)
     }
 
     LOG_INF("Bluetooth initialized OK");
+
+    ble_start_advertising();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -180,15 +203,18 @@ static struct bt_conn_auth_cb  auth_cb_display = {
 /*---------------------------------------------------------------------------*/
 void bas_notify(void)
 {
-    u8_t battery_level = bt_gatt_bas_get_battery_level();
-
-    battery_level--;
+    bt_gatt_bas_set_battery_level(lora_power_battery_level());
+}
 
-    if (!battery_level) {
-        battery_level = 100U;
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void bas_work_cb(struct k_work * work)
+{
+    if (ble_is_connected()) {
+        bas_notify();
+        k_delayed_work_submit(&bas_work, BAS_PERIOD_MS);
     }
-
-    bt_gatt_bas_set_battery_level(battery_level);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -198,6 +224,8 @@ int ble_base_init(void)
 {
     int err;
 
+    k_delayed_work_init(&bas_work, bas_work_cb);
+
     err = bt_enable(bt_ready);
     if (err) {
         LOG_INF("Bluetooth initialization failed: %d", err);
@@ -7,10 +7,13 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/printk.h>
+#include <sys/byteorder.h>
 #include <zephyr.h>
 
 #include "ble_policy.h"
 #include "ble_base.h"
+#include "metrics.h"
+#include "node_config.h"
 
 #define LOG_LEVEL 3
 #include <logging/log.h>
@@ -24,25 +27,22 @@ typedef struct ble_msg {
     u32_t       data;
 } ble_msg_t;
 
-#define QUEUE_ELEMENTS       8
 #define ALIGNMENT            4  // 32-bit alignment
 
-K_MSGQ_DEFINE(ble_queue, sizeof(ble_msg_t), QUEUE_ELEMENTS, ALIGNMENT);
+#if BLE_QUEUE_DEPTH < (BLE_ATT_MTU - 3) / 4
+#error "BLE_QUEUE_DEPTH must hold one full batch (BLE_CMD_BATCH_MAX)"
+#endif
 
-int  DeviceIdLen = 0;
-char DeviceId [MAX_DEVICEID_STRING_LEN];
-
-/*---------------------------------------------------------------------------*/
-/*                                                                           */
-/*---------------------------------------------------------------------------*/
-#define STACKSIZE 1024
+K_MSGQ_DEFINE(ble_queue, sizeof(ble_msg_t), BLE_QUEUE_DEPTH, ALIGNMENT);
+K_MSGQ_DEFINE(ble_urgent_queue, sizeof(ble_msg_t), BLE_QUEUE_URGENT_DEPTH, ALIGNMENT);
 
-struct k_thread ble_queue_thread;
-K_THREAD_STACK_DEFINE(ble_queue_stack, STACKSIZE);
+/* One count per message waiting in either lane */
+K_SEM_DEFINE(ble_queue_sem, 0, BLE_QUEUE_DEPTH + BLE_QUEUE_URGENT_DEPTH);
 
-static k_tid_t tBleQ;
+static struct ble_queue_stats queue_stats;
 
-static bool active = false;
+int  DeviceIdLen = 0;
+char DeviceId [MAX_DEVICEID_STRING_LEN];
 
 static struct k_work disconnect_work;
 
@@ -123,94 +123,200 @@ static void disconnect_work_cb(struct k_work * work)
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-void ble_policy_tasks(void)
+static bool ble_msg_is_urgent(ble_event_t event, u32_t data)
 {
-    while (active) {
+    return event == BLE_EVENT__VOICE && (data >> 24) == BLE_CMD__STOP;
+}
 
-        k_sleep(MSEC_PER_SEC);
+/*---------------------------------------------------------------------------*/
+/*  Put one message in its lane; the caller has checked for room.            */
+/*---------------------------------------------------------------------------*/
+static void ble_queue_put(ble_msg_t * msg)
+{
+    u32_t waiting;
 
-        if (ble_is_connected()) {
-            /* Battery level (simulation) */
-            bas_notify();
-        }
+    if (ble_msg_is_urgent(msg->event, msg->data)) {
+        k_msgq_put(&ble_urgent_queue, msg, K_NO_WAIT);
+        queue_stats.urgent++;
+    }
+    else {
+        k_msgq_put(&ble_queue, msg, K_NO_WAIT);
+    }
+
+    queue_stats.enqueued++;
+
+    waiting = k_msgq_num_used_get(&ble_queue) +
+              k_msgq_num_used_get(&ble_urgent_queue);
+    if (waiting > queue_stats.high_water) {
+        queue_stats.high_water = waiting;
     }
+    metrics_observe(METRIC_HIST_BLE_QUEUE_DEPTH, waiting);
+
+    k_sem_give(&ble_queue_sem);
 }
 
 /*---------------------------------------------------------------------------*/
-/*                                                                           */
+/*  Take the next message, STOP lane first.                                  */
+/*---------------------------------------------------------------------------*/
+static int ble_queue_get(ble_msg_t * msg, s32_t timeout)
+{
+    if (k_sem_take(&ble_queue_sem, timeout) != 0) {
+        return -EAGAIN;
+    }
+
+    if (k_msgq_get(&ble_urgent_queue, msg, K_NO_WAIT) == 0) {
+        return 0;
+    }
+    return k_msgq_get(&ble_queue, msg, K_NO_WAIT);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Returns -ENOMEM, leaving the queue untouched, when it is full.           */
 /*---------------------------------------------------------------------------*/
 int ble_enqueue_msg(ble_event_t event, u32_t data)
 {
+    struct k_msgq * lane;
     ble_msg_t msg;
 
     msg.event = event;
     msg.data  = data;
 
-    while (k_msgq_put(&ble_queue, &msg, K_NO_WAIT) != 0) {
-        LOG_ERR("%s: k_msgq_put error: purging queue", __func__);
-        k_msgq_purge(&ble_queue);
-        return -EIO;
+    lane = ble_msg_is_urgent(event, data) ? &ble_urgent_queue : &ble_queue;
+
+    k_sched_lock();
+
+    if (k_msgq_num_free_get(lane) == 0) {
+        queue_stats.refused++;
+        metrics_inc(METRIC_BLE_QUEUE_REFUSED);
+        k_sched_unlock();
+        LOG_WRN("%s: queue full", __func__);
+        return -ENOMEM;
     }
+
+    ble_queue_put(&msg);
+
+    k_sched_unlock();
+
     return 0;
 }
 
 /*---------------------------------------------------------------------------*/
-/*                                                                           */
+/*  Enqueue "count" little-endian u32_t commands from "buf", all or none:    */
+/*  returns -ENOMEM, leaving the queue untouched, if they do not all fit.    */
 /*---------------------------------------------------------------------------*/
-static void ble_queue_service(void)
+int ble_enqueue_batch(ble_event_t event, const u8_t * buf, u16_t count)
 {
-    int status;
     ble_msg_t msg;
-    
-    LOG_INF("%s: started", __func__);
+    u32_t urgent = 0;
+    int i;
 
-    while (1) {
+    msg.event = event;
 
-        k_msgq_get(&ble_queue, &msg, K_FOREVER);
+    for (i = 0; i < count; i++) {
+        if (ble_msg_is_urgent(event, sys_get_le32(&buf[i * sizeof(u32_t)]))) {
+            urgent++;
+        }
+    }
 
-        switch (msg.event) {
+    /* Keep other producers out between the space check and the puts */
+    k_sched_lock();
 
-            case BLE_EVENT__VOICE:
-                status = ble_command(msg.data);
-                ble_operation_complete(msg.event, status);
-                break;
+    if (k_msgq_num_free_get(&ble_urgent_queue) < urgent ||
+        k_msgq_num_free_get(&ble_queue) < count - urgent) {
+        queue_stats.refused += count;
+        metrics_add(METRIC_BLE_QUEUE_REFUSED, count);
+        k_sched_unlock();
+        LOG_WRN("%s: no room for %u commands", __func__, count);
+        return -ENOMEM;
+    }
 
-            default:
-                ble_operation_complete(msg.event, -EIO);
-                break;
-        }
+    for (i = 0; i < count; i++) {
+        msg.data = sys_get_le32(&buf[i * sizeof(u32_t)]);
+        ble_queue_put(&msg);
     }
+
+    k_sched_unlock();
+
+    return 0;
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-void ble_device_name(void)
+void ble_queue_get_stats(struct ble_queue_stats * stats)
 {
-    u32_t deviceid = NRF_FICR->DEVICEID[0];
+    k_sched_lock();
+    *stats = queue_stats;
+    k_sched_unlock();
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void ble_dispatch(ble_msg_t * msg)
+{
+    int status;
 
-    sprintf(DeviceId, "%s_%08x", CONFIG_BT_DEVICE_NAME, deviceid);
+    switch (msg->event) {
 
-    DeviceIdLen = strlen(DeviceId);
+        case BLE_EVENT__VOICE:
+            status = ble_command(msg->data);
+            ble_operation_complete(msg->event, status);
+            break;
 
-    printk("DeviceId: %s\n", DeviceId);
+        default:
+            ble_operation_complete(msg->event, -EIO);
+            break;
+    }
 }
 
 /*---------------------------------------------------------------------------*/
-/*                                                                           */
+/*  Let the application event loop wait for queued messages.                 */
 /*---------------------------------------------------------------------------*/
-static int ble_queue_init(void)
+void ble_queue_poll_init(struct k_poll_event * event)
 {
-    int status = 0;
+    k_poll_event_init(event, K_POLL_TYPE_SEM_AVAILABLE,
+                      K_POLL_MODE_NOTIFY_ONLY, &ble_queue_sem);
+}
 
-    tBleQ = k_thread_create(&ble_queue_thread, 
-                            ble_queue_stack, STACKSIZE,
-                            (k_thread_entry_t)ble_queue_service, 
-                            NULL, NULL, NULL, -1, K_USER, K_FOREVER);
+/*---------------------------------------------------------------------------*/
+/*  Process every queued message without blocking; returns the count.       */
+/*---------------------------------------------------------------------------*/
+int ble_queue_drain(void)
+{
+    ble_msg_t msg;
+    int count = 0;
 
-    k_thread_start(&ble_queue_thread);
+    while (ble_queue_get(&msg, K_NO_WAIT) == 0) {
+        ble_dispatch(&msg);
+        count++;
+    }
+    return count;
+}
 
-    return status;
+/*---------------------------------------------------------------------------*/
+/*  Stored name (node_config.h); built from the factory id on first boot.    */
+/*---------------------------------------------------------------------------*/
+void ble_device_name(void)
+{
+#ifdef NRF_FICR
+    u32_t deviceid = NRF_FICR->DEVICEID[0];
+#else
+    u32_t deviceid = 0;     // native_posix: no factory information
+#endif
+    const char * name = node_config_name();
+
+    if (name[0] != '\0') {
+        strncpy(DeviceId, name, sizeof(DeviceId) - 1);
+    }
+    else {
+        sprintf(DeviceId, "%s_%08x", CONFIG_BT_DEVICE_NAME, deviceid);
+        node_config_set_name(DeviceId);
+    }
+
+    DeviceIdLen = strlen(DeviceId);
+
+    printk("DeviceId: %s\n", DeviceId);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -241,25 +347,12 @@ int ble_policy_init(void)
         return status;
     }
 
-    /*
-     *  Start queue service on its own thread.
-     */
-    ble_queue_init();
-    if (status < 0) {
-        return status;
-    }
-
     disconnect_work.handler = disconnect_work_cb;
 
     /*
-     *  Indicate all is initialized.
-     */
-    active = true;
-
-    /* 
-     *  Start polling tasks: thread should never return. Keep last.
+     *  Queued messages are serviced by the application event loop
+     *  (ble_queue_poll_init, ble_queue_drain); battery updates run from
+     *  the system work queue while connected.
      */
-    ble_policy_tasks();
-
-    return -EINVAL;
+    return 0;
 }
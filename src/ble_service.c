@@ -7,6 +7,8 @@
 #include <errno.h>
 #include <zephyr.h>
 #include <init.h>
+#include <sys/byteorder.h>
+#include <sys/util.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -18,6 +20,9 @@
 #include "ble_base.h"
 #include "ble_uuids.h"
 #include "ble_service.h"
+#include "lora_app.h"
+#include "metrics.h"
+#include "node_config.h"
 
 #define LOG_LEVEL 3 //CONFIG_LOG_DEFAULT_LEVEL
 #include <logging/log.h>
@@ -46,7 +51,16 @@ static const struct bt_gatt_cpf command_cpf = {
   .description = 0x0100,    // Front
 };
 
-static u8_t paste_command[sizeof(u32_t)] = { 0x00 };
+#define PASTE_COMMAND_SIZE  (BLE_CMD_BATCH_MAX * sizeof(u32_t))
+
+/*
+ *  Last VOICE value written.  A long (prepared) write is delivered as a run
+ *  of chunks at increasing offsets; paste_len counts the bytes staged so far
+ *  and paste_queued how many of them have already been enqueued.
+ */
+static u8_t  paste_command[PASTE_COMMAND_SIZE] = { 0x00 };
+static u16_t paste_len;
+static u16_t paste_queued;
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
@@ -60,11 +74,13 @@ static ssize_t paste_read_command(struct bt_conn * conn,
     const char * value = attr->user_data;
 
     return bt_gatt_attr_read(conn, attr, buf, len, offset, value,
-                             sizeof(paste_command));
+                             paste_len);
 } 
 
 /*---------------------------------------------------------------------------*/
-/*                                                                           */
+/*  Accepts an array of u32_t commands.  The chunks of a long write are      */
+/*  staged, and each command is enqueued as soon as its last byte arrives;   */
+/*  a partial command left over when the next write starts is dropped.       */
 /*---------------------------------------------------------------------------*/
 static ssize_t  paste_write_command(struct bt_conn * conn,
                                     const struct bt_gatt_attr *attr,
@@ -74,27 +90,46 @@ static ssize_t  paste_write_command(struct bt_conn * conn,
                                     u8_t flags)
 {
     u8_t * data = attr->user_data;
+    u16_t  count;
 
-    //LOG_INF("%s: %02x", __func__, *data);
-
-    if (len > sizeof(u32_t)) {
-        LOG_ERR("%s: INVALID_LENGTH", __func__);
-        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    if (offset + len > PASTE_COMMAND_SIZE) {
+        LOG_ERR("%s: INVALID_OFFSET", __func__);
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
     }
 
-    ble_enqueue_msg(BLE_EVENT__VOICE, *(u32_t*)buf);
-
+    /* Prepare phase: only validate; the data comes again on execute */
     if (flags & BT_GATT_WRITE_FLAG_PREPARE) {
-        LOG_INF("%s: WRITE_FLAG_PREPARE", __func__);
         return 0;
     }
 
-    if (offset + len > sizeof(paste_command)) {
+    if (offset == 0) {
+        if (paste_queued != paste_len) {
+            LOG_ERR("%s: dropped %u trailing bytes", __func__,
+                    paste_len - paste_queued);
+        }
+        paste_len = 0;
+        paste_queued = 0;
+    }
+    else if (offset != paste_len) {
         LOG_ERR("%s: INVALID_OFFSET", __func__);
         return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
     }
 
     memcpy(data + offset, buf, len);
+    paste_len = offset + len;
+
+    count = (paste_len - paste_queued) / sizeof(u32_t);
+    if (count == 0) {
+        return len;
+    }
+
+    if (ble_enqueue_batch(BLE_EVENT__VOICE, data + paste_queued, count) != 0) {
+        /* Nothing was enqueued: the client may retry the same write */
+        paste_len = paste_queued;
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    }
+
+    paste_queued += count * sizeof(u32_t);
 
     return len;
 }
@@ -109,6 +144,173 @@ static void paste_ccc_cfg_changed(const struct bt_gatt_attr * attr, u16_t value)
   LOG_INF("notify %s", notif_enabled ? "enabled" : "disabled");
 }
 
+static bool lora_rx_enabled = false;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void lora_rx_ccc_cfg_changed(const struct bt_gatt_attr * attr, u16_t value)
+{
+  lora_rx_enabled = (value == BT_GATT_CCC_NOTIFY);
+
+  LOG_INF("LoRa RX notify %s", lora_rx_enabled ? "enabled" : "disabled");
+}
+
+/*---------------------------------------------------------------------------*/
+/*  LoRa uplink: the staged frame is complete once its header and "len"      */
+/*  payload bytes have arrived.                                              */
+/*---------------------------------------------------------------------------*/
+#define UPLINK_TAG(t)       (0x100 | (t))   // never LORA_APP_TAG_NONE
+#define UPLINK_IS_TAG(t)    ((t) & 0x100)
+
+static u8_t  uplink_buf[PASTE_UPLINK_HDR_LEN + LORA_FRAME_MAX_PAYLOAD];
+static u16_t uplink_len;
+
+static struct paste_uplink_stats uplink_stats;
+
+static void paste_uplink_done(u16_t tag, int status, u32_t airtime_us);
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static ssize_t lora_tx_write(struct bt_conn * conn,
+                             const struct bt_gatt_attr * attr,
+                             const void * buf,
+                             u16_t len,
+                             u16_t offset,
+                             u8_t flags)
+{
+    u16_t size;
+    u8_t  tag;
+    int   rc;
+
+    if (offset + len > sizeof(uplink_buf)) {
+        LOG_ERR("%s: INVALID_OFFSET", __func__);
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    /* Prepare phase: only validate; the data comes again on execute */
+    if (flags & BT_GATT_WRITE_FLAG_PREPARE) {
+        return 0;
+    }
+
+    if (offset == 0) {
+        uplink_len = 0;
+    }
+    else if (offset != uplink_len) {
+        LOG_ERR("%s: INVALID_OFFSET", __func__);
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    memcpy(uplink_buf + offset, buf, len);
+    uplink_len = offset + len;
+
+    if (uplink_len < PASTE_UPLINK_HDR_LEN) {
+        return len;
+    }
+
+    size = PASTE_UPLINK_HDR_LEN + uplink_buf[2];
+    if (uplink_len < size) {
+        return len;     // more chunks to come
+    }
+
+    if (uplink_len > size || uplink_buf[2] == 0 ||
+        uplink_buf[2] > LORA_FRAME_MAX_PAYLOAD) {
+        LOG_ERR("%s: INVALID_LENGTH", __func__);
+        uplink_len = 0;
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    uplink_len = 0;
+
+    tag = uplink_buf[0];
+
+    rc = lora_app_enqueue_tagged(uplink_buf[1], &uplink_buf[PASTE_UPLINK_HDR_LEN],
+                                 uplink_buf[2], UPLINK_TAG(tag), K_NO_WAIT);
+    if (rc < 0) {
+        uplink_stats.refused++;
+
+        if (flags & BT_GATT_WRITE_FLAG_CMD) {
+            /* No response to carry the error: report it as a completion */
+            paste_uplink_done(UPLINK_TAG(tag), rc, 0);
+            return len;
+        }
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    }
+
+    uplink_stats.queued++;
+
+    return len;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Metrics characteristic (see metrics.h for the layout).  The snapshot is  */
+/*  taken when a read starts at offset 0, so the chunks of a long read are   */
+/*  consistent with each other.                                              */
+/*---------------------------------------------------------------------------*/
+static u8_t  metrics_buf[METRICS_EXPORT_LEN];
+static u16_t metrics_len;
+
+static ssize_t metrics_read(struct bt_conn * conn,
+                            const struct bt_gatt_attr * attr,
+                            void * buf,
+                            u16_t len,
+                            u16_t offset)
+{
+    if (offset == 0) {
+        metrics_len = metrics_export(metrics_buf, sizeof(metrics_buf));
+    }
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, metrics_buf,
+                             metrics_len);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Config characteristic (see node_config.h for the record).  Reads return  */
+/*  the stored record; a write of a whole record stores it and restarts the  */
+/*  node on it.  Writing needs an encrypted link.                            */
+/*---------------------------------------------------------------------------*/
+static ssize_t config_read(struct bt_conn * conn,
+                           const struct bt_gatt_attr * attr,
+                           void * buf,
+                           u16_t len,
+                           u16_t offset)
+{
+    u8_t record[NODE_CONFIG_RECORD_LEN];
+
+    node_config_export(record, sizeof(record));
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, record,
+                             sizeof(record));
+}
+
+static ssize_t config_write(struct bt_conn * conn,
+                            const struct bt_gatt_attr * attr,
+                            const void * buf,
+                            u16_t len,
+                            u16_t offset,
+                            u8_t flags)
+{
+    int ret;
+
+    if (offset != 0) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    ret = node_config_import(buf, len);
+    if (ret == -EINVAL) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+    if (ret == -ERANGE) {
+        return BT_GATT_ERR(BT_ATT_ERR_OUT_OF_RANGE);
+    }
+    if (ret < 0) {
+        return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    }
+
+    return len;
+}
+
 /*---------------------------------------------------------------------------*/
 /* Service Declaration                                                       */
 /*---------------------------------------------------------------------------*/
@@ -125,26 +327,294 @@ BT_GATT_SERVICE_DEFINE(paste_svc,
         paste_read_command, paste_write_command, &paste_command),
     BT_GATT_CUD("Command", BT_GATT_PERM_READ),
     BT_GATT_CPF(&command_cpf),
+    BT_GATT_CHARACTERISTIC(BT_UUID_PASTE_LORA_RX, BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_NONE,
+        NULL, NULL, NULL),
+    BT_GATT_CCC(lora_rx_ccc_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CUD("LoRa RX", BT_GATT_PERM_READ),
+    BT_GATT_CHARACTERISTIC(BT_UUID_PASTE_LORA_TX,
+        (BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP |
+         BT_GATT_CHRC_NOTIFY | BT_GATT_CHRC_EXT_PROP),
+        (BT_GATT_PERM_WRITE | BT_GATT_PERM_PREPARE_WRITE),
+        NULL, lora_tx_write, NULL),
+    BT_GATT_CCC(paste_ccc_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CUD("LoRa TX", BT_GATT_PERM_READ),
+    BT_GATT_CHARACTERISTIC(BT_UUID_PASTE_METRICS, BT_GATT_CHRC_READ,
+        BT_GATT_PERM_READ,
+        metrics_read, NULL, NULL),
+    BT_GATT_CUD("Metrics", BT_GATT_PERM_READ),
+    BT_GATT_CHARACTERISTIC(BT_UUID_PASTE_CONFIG,
+        (BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE),
+        (BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT),
+        config_read, config_write, NULL),
+    BT_GATT_CUD("Config", BT_GATT_PERM_READ),
 );
 
+/* paste_svc.attrs[] indices of the notifying characteristics */
+#define PASTE_ATTR_NOTIFY       1
+#define PASTE_ATTR_LORA_RX      9
+#define PASTE_ATTR_LORA_TX      13
+
 /*---------------------------------------------------------------------------*/
-/*                                                                           */
+/*  Result aggregator                                                        */
+/*---------------------------------------------------------------------------*/
+struct paste_result {
+    u32_t cmd;
+    u32_t code;
+};
+
+#define PASTE_RESULT_MAX  ((BLE_ATT_MTU - 3) / sizeof(struct paste_result))
+
+static struct paste_result backlog[PASTE_NOTIFY_BACKLOG];
+static u16_t backlog_head;
+static u16_t backlog_count;
+
+static u8_t notify_buf[PASTE_RESULT_MAX * sizeof(struct paste_result)];
+
+static struct paste_notify_stats notify_stats;
+
+static struct k_delayed_work notify_work;
+
+K_MUTEX_DEFINE(notify_lock);
+
+/*---------------------------------------------------------------------------*/
+/*  Records that fit one notification on the current connection.             */
+/*---------------------------------------------------------------------------*/
+static u16_t paste_notify_capacity(void)
+{
+    u16_t count = (ble_get_mtu() - 3) / sizeof(struct paste_result);
+
+    return MAX(MIN(count, PASTE_RESULT_MAX), 1);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Send the backlog, one full notification at a time.  Call with the lock   */
+/*  held.  On -ENOMEM the remaining records stay queued and a retry is       */
+/*  scheduled.                                                               */
+/*---------------------------------------------------------------------------*/
+static int paste_notify_flush(void)
+{
+    struct paste_result * result;
+    u16_t count;
+    int   rc;
+    int   i;
+
+    while (backlog_count) {
+
+        if (!ble_is_connected()) {
+            notify_stats.dropped += backlog_count;
+            metrics_add(METRIC_BLE_NOTIFY_FAILED, backlog_count);
+            backlog_count = 0;
+            return -ENOTCONN;
+        }
+
+        count = MIN(backlog_count, paste_notify_capacity());
+
+        for (i = 0; i < count; i++) {
+            result = &backlog[(backlog_head + i) % PASTE_NOTIFY_BACKLOG];
+            sys_put_le32(result->cmd,  &notify_buf[i * sizeof(*result)]);
+            sys_put_le32(result->code, &notify_buf[i * sizeof(*result) + 4]);
+        }
+
+        rc = bt_gatt_notify(NULL, &paste_svc.attrs[PASTE_ATTR_NOTIFY],
+                            notify_buf, count * sizeof(struct paste_result));
+        if (rc == -ENOMEM) {
+            notify_stats.retries++;
+            k_delayed_work_submit(&notify_work, K_MSEC(PASTE_NOTIFY_RETRY_MS));
+            return rc;
+        }
+
+        if (rc < 0) {
+            LOG_ERR("%s: notify error %d", __func__, rc);
+            notify_stats.dropped += count;
+            metrics_add(METRIC_BLE_NOTIFY_FAILED, count);
+        }
+        else {
+            notify_stats.packets++;
+        }
+
+        backlog_head   = (backlog_head + count) % PASTE_NOTIFY_BACKLOG;
+        backlog_count -= count;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Deadline (or retry) expired: send whatever is pending.                   */
+/*---------------------------------------------------------------------------*/
+static void paste_notify_work_cb(struct k_work * work)
+{
+    k_mutex_lock(&notify_lock, K_FOREVER);
+    paste_notify_flush();
+    k_mutex_unlock(&notify_lock);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Queue one command result.                                                */
 /*---------------------------------------------------------------------------*/
 int paste_notify(u32_t cmd, u32_t code)
 {
-    struct {
-        u32_t cmd;
-        u32_t code;
-    } data;
+    struct paste_result * result;
 
-    data.cmd = cmd;
-    data.code = code;
+    if (!ble_is_connected()) {
+        return -ENOTCONN;
+    }
+
+    k_mutex_lock(&notify_lock, K_FOREVER);
+
+    if (backlog_count == PASTE_NOTIFY_BACKLOG) {
+        backlog_head = (backlog_head + 1) % PASTE_NOTIFY_BACKLOG;
+        backlog_count--;
+        notify_stats.dropped++;
+        metrics_inc(METRIC_BLE_NOTIFY_FAILED);
+    }
+
+    result = &backlog[(backlog_head + backlog_count) % PASTE_NOTIFY_BACKLOG];
+    result->cmd  = cmd;
+    result->code = code;
+    backlog_count++;
+    notify_stats.results++;
 
-    if (ble_is_connected()) {
-        int rc = bt_gatt_notify(NULL, &paste_svc.attrs[1], &data, sizeof(data));
-        return rc;
+    if (backlog_count >= paste_notify_capacity()) {
+        paste_notify_flush();
+    }
+    else if (backlog_count == 1) {
+        k_delayed_work_submit(&notify_work, K_MSEC(PASTE_NOTIFY_FLUSH_MS));
     }
-    else {
+
+    k_mutex_unlock(&notify_lock);
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void paste_notify_get_stats(struct paste_notify_stats * stats)
+{
+    k_mutex_lock(&notify_lock, K_FOREVER);
+    *stats = notify_stats;
+    k_mutex_unlock(&notify_lock);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+bool paste_lora_subscribed(void)
+{
+    return ble_is_connected() && lora_rx_enabled;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Returns -ENOMEM when the stack is out of TX buffers.                     */
+/*---------------------------------------------------------------------------*/
+int paste_lora_notify(const u8_t * data, u16_t len)
+{
+    if (!paste_lora_subscribed()) {
         return -ENOTCONN;
     }
+    return bt_gatt_notify(NULL, &paste_svc.attrs[PASTE_ATTR_LORA_RX], data, len);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Uplink completions                                                       */
+/*---------------------------------------------------------------------------*/
+K_MSGQ_DEFINE(uplink_done_queue, PASTE_UPLINK_DONE_LEN, PASTE_UPLINK_BACKLOG, 1);
+
+static u8_t  uplink_done_buf[BLE_ATT_MTU - 3];
+static u16_t uplink_done_len;
+
+static struct k_delayed_work uplink_work;
+
+/*---------------------------------------------------------------------------*/
+/*  TX completion callback: runs on the radio thread, so only queue it.      */
+/*---------------------------------------------------------------------------*/
+static void paste_uplink_done(u16_t tag, int status, u32_t airtime_us)
+{
+    u8_t record[PASTE_UPLINK_DONE_LEN];
+
+    if (!UPLINK_IS_TAG(tag)) {
+        return;
+    }
+
+    record[0] = tag & 0xFF;
+    record[1] = (u8_t)MAX(status, INT8_MIN);
+    sys_put_le32(airtime_us, &record[2]);
+
+    if (k_msgq_put(&uplink_done_queue, record, K_NO_WAIT) != 0) {
+        uplink_stats.dropped++;
+        return;
+    }
+
+    k_delayed_work_submit(&uplink_work, K_NO_WAIT);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Pack the waiting completions into notifications.  A notification the     */
+/*  stack has no buffer for is kept and retried.                             */
+/*---------------------------------------------------------------------------*/
+static void paste_uplink_work_cb(struct k_work * work)
+{
+    u16_t room;
+    int   rc;
+
+    while (1) {
+
+        if (uplink_done_len == 0) {
+            room = MIN(ble_get_mtu() - 3, sizeof(uplink_done_buf));
+
+            while (uplink_done_len + PASTE_UPLINK_DONE_LEN <= room &&
+                   k_msgq_get(&uplink_done_queue,
+                              &uplink_done_buf[uplink_done_len], K_NO_WAIT) == 0) {
+                uplink_done_len += PASTE_UPLINK_DONE_LEN;
+            }
+
+            if (uplink_done_len == 0) {
+                return;
+            }
+        }
+
+        if (!ble_is_connected()) {
+            uplink_stats.dropped += uplink_done_len / PASTE_UPLINK_DONE_LEN;
+            uplink_done_len = 0;
+            continue;
+        }
+
+        rc = bt_gatt_notify(NULL, &paste_svc.attrs[PASTE_ATTR_LORA_TX],
+                            uplink_done_buf, uplink_done_len);
+        if (rc == -ENOMEM) {
+            k_delayed_work_submit(&uplink_work, K_MSEC(PASTE_NOTIFY_RETRY_MS));
+            return;
+        }
+
+        if (rc < 0) {
+            uplink_stats.dropped += uplink_done_len / PASTE_UPLINK_DONE_LEN;
+        }
+        else {
+            uplink_stats.completions += uplink_done_len / PASTE_UPLINK_DONE_LEN;
+        }
+        uplink_done_len = 0;
+    }
 }
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void paste_uplink_get_stats(struct paste_uplink_stats * stats)
+{
+    *stats = uplink_stats;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int paste_service_init(struct device * dev)
+{
+    k_delayed_work_init(&notify_work, paste_notify_work_cb);
+    k_delayed_work_init(&uplink_work, paste_uplink_work_cb);
+
+    lora_app_set_tx_callback(paste_uplink_done);
+    return 0;
+}
+
+SYS_INIT(paste_service_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
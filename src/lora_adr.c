@@ -0,0 +1,299 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "lora_adr.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_adr);
+
+/*---------------------------------------------------------------------------*/
+/*  Demodulator SNR floor per spreading factor (SX1276 datasheet), dB * 16.  */
+/*---------------------------------------------------------------------------*/
+static const s16_t snr_floor_q4[] = {
+    -120,   // SF7:  -7.5dB
+    -160,   // SF8:  -10dB
+    -200,   // SF9:  -12.5dB
+    -240,   // SF10: -15dB
+    -280,   // SF11: -17.5dB
+    -320,   // SF12: -20dB
+};
+
+#define SNR_FLOOR_Q4(sf)  snr_floor_q4[(sf) - SF_7]
+
+static struct lora_adr_link links[LORA_ADR_MAX_LINKS];
+
+static enum lora_datarate datarate = LORA_ADR_SF_MIN;   // in use
+static enum lora_datarate need = LORA_ADR_SF_MIN;       // our links' need
+static enum lora_datarate announced = LORA_ADR_SF_MIN;  // need last sent
+
+static u32_t settle_frames;
+static u32_t last_step;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_adr_init(enum lora_datarate initial)
+{
+    memset(links, 0, sizeof(links));
+
+    datarate = MIN(MAX(initial, LORA_ADR_SF_MIN), LORA_ADR_SF_MAX);
+    need = datarate;
+    announced = datarate;
+    settle_frames = 0;
+    last_step = k_uptime_get_32();
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static struct lora_adr_link * adr_link_find(u8_t id)
+{
+    int i;
+
+    for (i = 0; i < LORA_ADR_MAX_LINKS; i++) {
+        if (links[i].used && links[i].id == id) {
+            return &links[i];
+        }
+    }
+    return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static bool adr_link_active(const struct lora_adr_link * link, u32_t now)
+{
+    return link && link->used && (now - link->last_seen) <= LORA_ADR_SILENCE_MS;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Fastest spreading factor that still leaves the installation margin.      */
+/*  The reported SNR is roughly independent of SF, so one average serves.    */
+/*---------------------------------------------------------------------------*/
+static enum lora_datarate adr_link_best_sf(const struct lora_adr_link * link)
+{
+    enum lora_datarate sf;
+
+    for (sf = LORA_ADR_SF_MIN; sf < LORA_ADR_SF_MAX; sf++) {
+        if (link->snr_q4 >= SNR_FLOOR_Q4(sf) + LORA_ADR_MARGIN_DB * 16) {
+            break;
+        }
+    }
+    return sf;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Move our need toward what the weakest active link needs.  Steps up       */
+/*  (more reach) right away, steps down one SF at a time after settling.     */
+/*  Only the need changes here: it takes effect when it is next sent.        */
+/*---------------------------------------------------------------------------*/
+static void adr_evaluate(u32_t now)
+{
+    enum lora_datarate target = LORA_ADR_SF_MIN;
+    enum lora_datarate sf;
+    bool active = false;
+    int  i;
+
+    for (i = 0; i < LORA_ADR_MAX_LINKS; i++) {
+        if (adr_link_active(&links[i], now)) {
+            target = MAX(target, adr_link_best_sf(&links[i]));
+            active = true;
+        }
+    }
+
+    if (!active) {
+        return;
+    }
+
+    if (target > need) {
+        sf = target;
+    }
+    else if (target < need && settle_frames >= LORA_ADR_SETTLE_FRAMES) {
+        sf = need - 1;
+    }
+    else {
+        return;
+    }
+
+    LOG_INF("ADR: need SF%u -> SF%u", need, sf);
+
+    need = sf;
+    settle_frames = 0;
+    last_step = now;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Network SF: the highest of the need we announced and the needs active    */
+/*  peers announced to us.                                                   */
+/*---------------------------------------------------------------------------*/
+static void adr_apply(u32_t now)
+{
+    enum lora_datarate sf = announced;
+    int i;
+
+    for (i = 0; i < LORA_ADR_MAX_LINKS; i++) {
+        if (adr_link_active(&links[i], now) && links[i].need) {
+            sf = MAX(sf, links[i].need);
+        }
+    }
+
+    if (sf != datarate) {
+        LOG_INF("ADR: SF%u -> SF%u", datarate, sf);
+        datarate = sf;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Feed the RSSI/SNR of a frame received from "src", and the SF it needs    */
+/*  (0 if it sent none).  The sender moves to the network SF right after     */
+/*  sending, so follow it now.                                               */
+/*---------------------------------------------------------------------------*/
+void lora_adr_update(u8_t src, s16_t rssi, s8_t snr, u8_t sf, u32_t now)
+{
+    struct lora_adr_link * link = adr_link_find(src);
+    struct lora_adr_link * oldest;
+    int i;
+
+    if (!link) {
+        /* Take a free slot, or recycle the least recently heard link */
+        oldest = &links[0];
+        for (i = 0; i < LORA_ADR_MAX_LINKS; i++) {
+            if (!links[i].used) {
+                oldest = &links[i];
+                break;
+            }
+            if ((now - links[i].last_seen) > (now - oldest->last_seen)) {
+                oldest = &links[i];
+            }
+        }
+        link = oldest;
+        link->used   = true;
+        link->id     = src;
+        link->frames = 0;
+    }
+
+    if (link->frames == 0 || !adr_link_active(link, now)) {
+        link->snr_q4 = snr * 16;
+        link->rssi   = rssi;
+    }
+    else {
+        /* Exponential average, weight 1/8 */
+        link->snr_q4 += (snr * 16 - link->snr_q4) / 8;
+        link->rssi   += (rssi - link->rssi) / 8;
+    }
+
+    link->last_seen = now;
+    if (link->frames < UINT16_MAX) {
+        link->frames++;
+    }
+
+    settle_frames++;
+    adr_evaluate(now);
+
+    if (sf >= LORA_ADR_SF_MIN && sf <= LORA_ADR_SF_MAX) {
+        link->need = sf;
+        adr_apply(now);
+    }
+    else {
+        link->need = 0;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  A frame carrying our need is on air: peers that heard it are moving to   */
+/*  the network SF, so move with them.                                       */
+/*---------------------------------------------------------------------------*/
+void lora_adr_tx_done(u32_t now)
+{
+    announced = need;
+    adr_apply(now);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  With no active link, step toward SF12 once per silence period so that    */
+/*  peers which drifted apart meet again at the longest reach.  The need     */
+/*  rises with it, so a peer met there is not pulled straight back down.     */
+/*---------------------------------------------------------------------------*/
+void lora_adr_tick(u32_t now)
+{
+    int i;
+
+    if (now - last_step < LORA_ADR_SILENCE_MS) {
+        return;
+    }
+
+    for (i = 0; i < LORA_ADR_MAX_LINKS; i++) {
+        if (adr_link_active(&links[i], now)) {
+            return;
+        }
+    }
+
+    last_step = now;
+
+    if (datarate < LORA_ADR_SF_MAX) {
+        LOG_INF("ADR: no link, SF%u -> SF%u", datarate, datarate + 1);
+        datarate++;
+        need = datarate;
+        announced = datarate;
+        settle_frames = 0;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+enum lora_datarate lora_adr_datarate(void)
+{
+    return datarate;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  SF to announce in outgoing frames.                                       */
+/*---------------------------------------------------------------------------*/
+enum lora_datarate lora_adr_need(void)
+{
+    return need;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  TX power toward "dst": back off from the maximum by whole power steps    */
+/*  of SNR excess.  The link is assumed symmetric, with the peer sending at  */
+/*  up to LORA_ADR_POWER_MAX; a peer that sends lower only makes this more   */
+/*  conservative.  Unknown links and broadcasts get full power.              */
+/*---------------------------------------------------------------------------*/
+s8_t lora_adr_tx_power(u8_t dst, u32_t now)
+{
+    struct lora_adr_link * link = adr_link_find(dst);
+    int excess;
+    int power;
+
+    if (!adr_link_active(link, now)) {
+        return LORA_ADR_POWER_MAX;
+    }
+
+    excess = (link->snr_q4 - SNR_FLOOR_Q4(datarate)) / 16 - LORA_ADR_MARGIN_DB;
+    if (excess <= 0) {
+        return LORA_ADR_POWER_MAX;
+    }
+
+    power = LORA_ADR_POWER_MAX - (excess / LORA_ADR_POWER_STEP) * LORA_ADR_POWER_STEP;
+
+    return MAX(power, LORA_ADR_POWER_MIN);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+const struct lora_adr_link * lora_adr_link_get(u8_t id)
+{
+    return adr_link_find(id);
+}
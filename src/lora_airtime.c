@@ -0,0 +1,154 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "lora_airtime.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_airtime);
+
+/*---------------------------------------------------------------------------*/
+/*  Time on air of a "len" byte packet, in microseconds (Semtech AN1200.13). */
+/*  Matches the sx1276 driver settings: explicit header, CRC on, and low     */
+/*  data rate optimization whenever a symbol lasts longer than 16ms.         */
+/*---------------------------------------------------------------------------*/
+u32_t lora_airtime_us(const struct lora_modem_config * config, u8_t len)
+{
+    u32_t sf     = config->datarate;
+    u32_t bw_hz  = 125000U << config->bandwidth;
+    u32_t tsym   = (BIT(sf) * USEC_PER_SEC) / bw_hz;   // exact for 125/250/500kHz
+    u32_t de     = (tsym > 16000) ? 1 : 0;
+    s32_t num;
+    u32_t den;
+    u32_t symbols;
+
+    /* Preamble plus 4.25 symbols of sync word */
+    u32_t preamble_us = (tsym * (4 * config->preamble_len + 17)) / 4;
+
+    /* 8PL - 4SF + 28 + 16CRC - 20IH, with CRC = 1 and IH = 0 */
+    num = 8 * len - 4 * sf + 28 + 16;
+    den = 4 * (sf - 2 * de);
+
+    symbols = 8;
+    if (num > 0) {
+        symbols += ((num + den - 1) / den) * (config->coding_rate + 4);
+    }
+
+    return preamble_us + symbols * tsym;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Duty-cycle token bucket, in microseconds of airtime.                     */
+/*---------------------------------------------------------------------------*/
+#define DUTY_BUDGET_US  ((u64_t)LORA_DUTY_WINDOW_MS * LORA_DUTY_CYCLE_PERMILLE)
+
+/* The refill rate is budget - burst: it must not underflow */
+BUILD_ASSERT(LORA_DUTY_CYCLE_PERMILLE == 0 ||
+             DUTY_BUDGET_US > LORA_DUTY_BURST_US);
+
+static u32_t tokens;
+static u32_t last_refill;
+
+/*---------------------------------------------------------------------------*/
+/*  Bucket level at "now", without updating it: safe from any thread.        */
+/*---------------------------------------------------------------------------*/
+static u32_t duty_tokens(u32_t now)
+{
+    u64_t refill;
+
+    /* Burst + refill over one window must fit the budget */
+    refill = ((u64_t)(now - last_refill) * (DUTY_BUDGET_US - LORA_DUTY_BURST_US)) /
+             LORA_DUTY_WINDOW_MS;
+
+    return MIN((u64_t)tokens + refill, LORA_DUTY_BURST_US);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void duty_refill(u32_t now)
+{
+    u32_t level = duty_tokens(now);
+
+    /* Leave last_refill alone on a zero refill so short steps accumulate */
+    if (level != tokens || level == LORA_DUTY_BURST_US) {
+        tokens = level;
+        last_refill = now;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_duty_init(u32_t now)
+{
+    tokens = LORA_DUTY_BURST_US;
+    last_refill = now;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Airtime that may be spent right now.                                     */
+/*---------------------------------------------------------------------------*/
+u32_t lora_duty_budget_us(u32_t now)
+{
+    if (LORA_DUTY_CYCLE_PERMILLE == 0) {
+        return UINT32_MAX;
+    }
+
+    return duty_tokens(now);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Milliseconds until "airtime_us" fits the budget: 0 means send now,       */
+/*  UINT32_MAX means never (larger than the bucket).                         */
+/*---------------------------------------------------------------------------*/
+u32_t lora_duty_wait_ms(u32_t airtime_us, u32_t now)
+{
+    u64_t missing;
+
+    if (LORA_DUTY_CYCLE_PERMILLE == 0) {
+        return 0;
+    }
+
+    if (airtime_us > LORA_DUTY_BURST_US) {
+        return UINT32_MAX;
+    }
+
+    duty_refill(now);
+
+    if (tokens >= airtime_us) {
+        return 0;
+    }
+
+    missing = airtime_us - tokens;
+
+    return (u32_t)((missing * LORA_DUTY_WINDOW_MS +
+                    (DUTY_BUDGET_US - LORA_DUTY_BURST_US) - 1) /
+                   (DUTY_BUDGET_US - LORA_DUTY_BURST_US));
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Charge a transmission against the budget.                                */
+/*---------------------------------------------------------------------------*/
+int lora_duty_consume(u32_t airtime_us, u32_t now)
+{
+    if (LORA_DUTY_CYCLE_PERMILLE == 0) {
+        return 0;
+    }
+
+    duty_refill(now);
+
+    if (tokens < airtime_us) {
+        return -EAGAIN;
+    }
+
+    tokens -= airtime_us;
+    return 0;
+}
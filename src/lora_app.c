@@ -7,10 +7,28 @@
 #include <device.h>
 #include <drivers/lora.h>
 #include <errno.h>
+#include <string.h>
+#include <sys/byteorder.h>
 #include <sys/util.h>
 #include <zephyr.h>
 
 #include "lora_app.h"
+#include "lora_adr.h"
+#include "lora_airtime.h"
+#include "lora_codec.h"
+#include "lora_frag.h"
+#include "lora_hop.h"
+#include "lora_lbt.h"
+#include "lora_power.h"
+#include "lora_prof.h"
+#include "metrics.h"
+#include "node_config.h"
+#include "trace.h"
+
+/* SPIM aborts the SX1276 driver's one-byte address phase on nRF52832 (PAN 58) */
+#if defined(CONFIG_SPI_1_NRF_SPIM) && defined(CONFIG_SOC_NRF52832)
+#error "SX1276 on spi1 needs the legacy SPI peripheral on nRF52832"
+#endif
 
 #define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
 #include <logging/log.h>
@@ -48,27 +66,117 @@ LOG_MODULE_REGISTER(lora_app);
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
 
-#define FROM_ID 1
-#define TO_ID   2
+/* Stored per node in flash (node_config.h) */
+#define FROM_ID (node_config.node_id)
+#define TO_ID   (node_config.peer_id)
 
-#define MAX_SEND_DATA_LEN 16
-char send_data[MAX_SEND_DATA_LEN] = {TO_ID, FROM_ID, 0, 0, 
+#define MAX_SEND_DATA_LEN 12
+u8_t send_data[MAX_SEND_DATA_LEN] = {
                'h', 'e', 'l', 'l', 'o', ',', ' ', 'w', 'o', 'r', 'l', 'd'};
 
-#define MAX_RECEIVE_DATA_LEN  255
-char receive_data[MAX_RECEIVE_DATA_LEN] = {0};
+/* Scratch frame: keeps the radio drained while the RX pool is exhausted */
+static lora_rx_frame_t rx_scratch;
+
+/* A slot offset must fit the frame's slot byte */
+BUILD_ASSERT(LORA_HOP_DWELL_MS / LORA_FRAME_SLOT_UNIT_MS < LORA_FRAME_SLOT_NONE);
+
+/* Expanded payload of a coded frame, copied back over the frame */
+static u8_t codec_buf[LORA_FRAME_MAX_PAYLOAD];
 
 static struct device * lora_dev;
 static bool initialized = false;
 
+static struct lora_modem_config modem_config;
+static lora_dir_t direction = LORA_DIR__NONE;
+static u8_t radio_channel;      // hop channel the radio is tuned to
+
+static struct lora_app_stats stats;
+
+/*---------------------------------------------------------------------------*/
+/*  TX queue: producers enqueue frames, the radio thread drains them.        */
+/*---------------------------------------------------------------------------*/
+typedef struct {
+    u32_t enqueued;     // k_cycle_get_32() at enqueue time
+    u32_t airtime;      // time on air so far, retransmissions included
+    u16_t tag;          // reported to tx_callback unless LORA_APP_TAG_NONE
+    u8_t  dst;
+    u8_t  len;          // payload length
+    u8_t  seq;          // assigned when the frame is taken off the queue
+    u8_t  flags;
+    u8_t  retries;
+    u8_t  data[LORA_APP_MAX_FRAME_LEN];  // payload at LORA_FRAME_PAYLOAD
+} lora_tx_frame_t;
+
+#define ALIGNMENT  4  // 32-bit alignment
+
+K_MSGQ_DEFINE(lora_tx_queue, sizeof(lora_tx_frame_t), 
+              LORA_APP_TX_QUEUE_DEPTH, ALIGNMENT);
+
+static lora_tx_frame_t tx_frame;
+static lora_tx_frame_t * tx_current;    // tx_frame or a window entry
+static bool  tx_pending;
+static u32_t tx_next_send;
+static u8_t  tx_attempts;       // busy channels met by the pending frame
+static u32_t tx_backoff_until;
+
+static u8_t  tx_seq;
+static u64_t tx_latency_sum;
+static u32_t tx_latency_samples;
+static u32_t rate_frames;
+static u32_t rate_tx_bytes;
+static u32_t rate_goodput_bytes;
+static s64_t rate_start;
+
+/*---------------------------------------------------------------------------*/
+/*  Reliable delivery: a selective-repeat window of frames to one peer.      */
+/*---------------------------------------------------------------------------*/
+typedef enum {
+    ARQ_FREE = 0,
+    ARQ_DUE,            // to be sent, or sent again
+    ARQ_SENT,           // on air, not yet acknowledged
+} arq_state_t;
+
+static lora_tx_frame_t arq_frames[LORA_APP_ARQ_WINDOW];
+static arq_state_t     arq_state[LORA_APP_ARQ_WINDOW];
+
+static bool  reliable = LORA_APP_RELIABLE;
+static u8_t  arq_dst;
+static bool  arq_waiting;       // POLL sent, waiting for the SACK
+static u32_t arq_deadline;
+
+/* Selective ACK owed to a peer that polled */
+static lora_tx_frame_t ack_frame;
+static bool  ack_pending;
+static u8_t  ack_dst;
+
+static struct k_delayed_work beacon_work;
+
+static lora_app_tx_cb_t tx_callback;
+
+/*---------------------------------------------------------------------------*/
+/*  RX pool: frames are received in place and passed on by pointer.          */
+/*---------------------------------------------------------------------------*/
+K_MEM_SLAB_DEFINE(lora_rx_slab, sizeof(lora_rx_frame_t), 
+                  LORA_APP_RX_POOL_FRAMES, ALIGNMENT);
+
+K_FIFO_DEFINE(lora_rx_fifo);
+
+static struct lora_frame_dedup rx_dedup;
+
+static lora_app_rx_cb_t rx_callback;
+
+static u32_t retry_ms;
+
+/* Low-power mode: the radio thread sleeps on tx_wake between RX windows */
+static lora_app_power_t power_mode = LORA_APP_POWER_DEFAULT;
+K_SEM_DEFINE(tx_wake, 0, 1);
+static volatile u32_t tx_wake_at;  // k_cycle_get_32() at the last enqueue
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
 int lora_app_init(void)
 {
-    struct lora_modem_config config;
-    int ret;
-
     if (initialized) {
         return 0;
     }
@@ -81,40 +189,29 @@ int lora_app_init(void)
         return -1;
     }
 
-#if 0
-    config.frequency = 904300000; // FIXME make this a parameter.
-    config.bandwidth = BW_125_KHZ;
-    config.datarate = SF_7;
-    config.preamble_len = 8;
-    config.coding_rate = CR_4_5;
-    config.tx_power = 21;
-    config.tx = true;
-#else
-    config.frequency = 915000000;    // FIXME make this a parameter.
-    config.bandwidth = BW_125_KHZ;
-    config.datarate = SF_7;
-    config.preamble_len = 8;
-    config.coding_rate = CR_4_5;
-    config.tx_power = 14;
-#endif
+    modem_config.frequency = node_config.frequency;
+    modem_config.bandwidth = node_config.bandwidth;
+    modem_config.datarate = node_config.datarate;
+    modem_config.preamble_len = 8;
+    modem_config.coding_rate = CR_4_5;
+    modem_config.tx_power = node_config.tx_power;
 
-#ifdef LORA_APP_TX_MODE
-    config.tx = true;
-#else
-    config.tx = false;
-#endif
+    lora_adr_init(modem_config.datarate);
+    lora_duty_init(k_uptime_get_32());
+    lora_hop_init(FROM_ID == LORA_HOP_MASTER_ID, k_uptime_get_32());
+    lora_frag_init();
+    lora_prof_init();
 
-    LOG_INF("%s mode ---------",   (config.tx) ? "TX" : "RX");
-    LOG_INF("frequency:    %uHz", config.frequency);
-    LOG_INF("bandwidth:    %u",   config.bandwidth);
-    LOG_INF("datarate:     %u",   config.datarate);
-    LOG_INF("preamble_len: %u",   config.preamble_len);
-    LOG_INF("coding_rate:  %u",   config.coding_rate);
-    LOG_INF("tx_power:     %u",   config.tx_power);
+    LOG_INF("Radio config ---------");
+    LOG_INF("frequency:    %uHz", modem_config.frequency);
+    LOG_INF("bandwidth:    %u",   modem_config.bandwidth);
+    LOG_INF("datarate:     %u",   modem_config.datarate);
+    LOG_INF("preamble_len: %u",   modem_config.preamble_len);
+    LOG_INF("coding_rate:  %u",   modem_config.coding_rate);
+    LOG_INF("tx_power:     %u",   modem_config.tx_power);
 
-    ret = lora_config(lora_dev, &config);
-    if (ret < 0) {
-        LOG_ERR("LoRa config failed");
+    /* Start out listening */
+    if (lora_app_set_direction(LORA_DIR__RX) < 0) {
         initialized = false;
         return -1;
     }
@@ -124,44 +221,1114 @@ int lora_app_init(void)
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-void lora_app_receive( void )
+static u32_t lora_app_frequency(u8_t channel)
 {
-    int   len;
-    s16_t rssi;
-    s8_t  snr;
+    return lora_hop_enabled() ? lora_hop_frequency(channel)
+                              : node_config.frequency;
+}
 
-    while (1) {
-        /* Block until data arrives */
-        LOG_INF("Receive posted...");
-        len = lora_recv(lora_dev, receive_data, 
-                        MAX_RECEIVE_DATA_LEN, K_FOREVER, &rssi, &snr);
-        if (len < 0) {
-            LOG_ERR("LoRa receive failed");
-            return;
+/*---------------------------------------------------------------------------*/
+/*  Bring the half-duplex radio to "dir" on "channel" with the given SF and  */
+/*  TX power.  lora_config is only issued when one of them actually changes; */
+/*  TX power does not matter while receiving.  A hop that coincides with a   */
+/*  turnaround or SF change costs no extra lora_config.                      */
+/*---------------------------------------------------------------------------*/
+static int lora_app_configure(lora_dir_t dir, u8_t channel,
+                              enum lora_datarate datarate, s8_t tx_power)
+{
+    u32_t frequency = lora_app_frequency(channel);
+    struct lora_prof_stamp prof;
+    bool  turnaround;
+    bool  reconfig;
+    u32_t start;
+    u32_t elapsed;
+    int   ret;
+
+    radio_channel = channel;
+
+    if (dir == direction && datarate == modem_config.datarate &&
+        frequency == modem_config.frequency &&
+        (dir == LORA_DIR__RX || tx_power == modem_config.tx_power)) {
+        return 0;
+    }
+
+    turnaround = (direction != LORA_DIR__NONE && dir != direction);
+    reconfig = (datarate != modem_config.datarate ||
+                (dir == LORA_DIR__TX && tx_power != modem_config.tx_power));
+
+    start = k_cycle_get_32();
+
+    lora_power_enter(LORA_POWER__STANDBY);
+
+    modem_config.tx = (dir == LORA_DIR__TX);
+    modem_config.frequency = frequency;
+    modem_config.datarate = datarate;
+    if (dir == LORA_DIR__TX) {
+        modem_config.tx_power = tx_power;
+    }
+
+    lora_prof_stamp(&prof);
+    ret = lora_config(lora_dev, &modem_config);
+    lora_prof_config(&prof);
+    if (ret < 0) {
+        LOG_ERR("LoRa config failed");
+        direction = LORA_DIR__NONE;
+        return ret;
+    }
+
+    elapsed = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+    if (turnaround) {
+        stats.turnarounds++;
+        stats.turnaround_last_us = elapsed;
+        if (elapsed > stats.turnaround_max_us) {
+            stats.turnaround_max_us = elapsed;
         }
+        LOG_DBG("turnaround to %s: %uus", (dir == LORA_DIR__TX) ? "TX" : "RX",
+                elapsed);
+    }
+    else if (direction != LORA_DIR__NONE && reconfig) {
+        stats.reconfigs++;
+        trace_event(TRACE_LEVEL__ALL, TRACE_EV__RECONFIG, 0, 0, datarate,
+                    tx_power, 0);
+    }
+    else if (direction != LORA_DIR__NONE) {
+        stats.retunes++;
+        trace_event(TRACE_LEVEL__ALL, TRACE_EV__RETUNE, 0, 0, channel, 0, 0);
+    }
+
+    direction = dir;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Switch the radio between RX and TX at the current ADR data rate.         */
+/*---------------------------------------------------------------------------*/
+int lora_app_set_direction(lora_dir_t dir)
+{
+    return lora_app_configure(dir, lora_hop_channel(k_uptime_get_32()),
+                              lora_adr_datarate(), modem_config.tx_power);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+u32_t lora_app_turnaround_us(void)
+{
+    return stats.turnaround_last_us;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_app_get_stats(struct lora_app_stats * out)
+{
+    *out = stats;
+    out->duty_budget_us = lora_duty_budget_us(k_uptime_get_32());
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Predicted uptime (ms) at which the next queued frame may go on air.      */
+/*---------------------------------------------------------------------------*/
+u32_t lora_app_next_send_ms(void)
+{
+    return tx_pending ? tx_next_send : k_uptime_get_32();
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Queue a frame for transmission.  Safe to call from any thread.           */
+/*---------------------------------------------------------------------------*/
+int lora_app_enqueue(u8_t dst, const u8_t * data, u8_t len, s32_t timeout)
+{
+    return lora_app_enqueue_tagged(dst, data, len, LORA_APP_TAG_NONE, timeout);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  As lora_app_enqueue, with a tag for the TX completion callback.          */
+/*---------------------------------------------------------------------------*/
+int lora_app_enqueue_tagged(u8_t dst, const u8_t * data, u8_t len, u16_t tag,
+                            s32_t timeout)
+{
+    return lora_app_enqueue_flags(dst, data, len, tag, 0, timeout);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  As lora_app_enqueue_tagged, with frame flags for layers above (such as   */
+/*  LORA_FRAME_FLAG_FRAG); POLL and ACK are the scheduler's own.             */
+/*---------------------------------------------------------------------------*/
+int lora_app_enqueue_flags(u8_t dst, const u8_t * data, u8_t len, u16_t tag,
+                           u8_t flags, s32_t timeout)
+{
+    int ret;
+
+    /* Built on the stack: k_msgq_put copies it into the queue */
+    lora_tx_frame_t frame;
+
+    if (len == 0 || len > LORA_FRAME_MAX_PAYLOAD) {
+        return -EINVAL;
+    }
+
+    frame.dst      = dst;
+    frame.len      = 0;
+    frame.tag      = tag;
+    frame.flags    = flags & ~(LORA_FRAME_FLAG_POLL | LORA_FRAME_FLAG_ACK |
+                               LORA_FRAME_FLAG_CODEC | LORA_FRAME_SF_MASK);
+
+#if LORA_CODEC_ENABLED
+    /* Keep the coded payload only if it saves at least one byte */
+    ret = lora_codec_compress(data, len, LORA_FRAME_PAYLOAD(frame.data),
+                              len - 1);
+    if (ret > 0) {
+        frame.len    = ret;
+        frame.flags |= LORA_FRAME_FLAG_CODEC;
+    }
+#endif
+
+    if (frame.len == 0) {
+        memcpy(LORA_FRAME_PAYLOAD(frame.data), data, len);
+        frame.len = len;
+    }
+
+    frame.enqueued = k_cycle_get_32();
+
+    if (k_msgq_put(&lora_tx_queue, &frame, timeout) != 0) {
+        stats.tx_queue_full++;
+        return -ENOMEM;
+    }
+
+    tx_wake_at = k_cycle_get_32();
+    k_sem_give(&tx_wake);
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_app_set_tx_callback(lora_app_tx_cb_t cb)
+{
+    tx_callback = cb;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Report the outcome of a tagged frame.                                    */
+/*---------------------------------------------------------------------------*/
+static void lora_app_tx_done(lora_tx_frame_t * frame, int status, u32_t airtime)
+{
+    lora_app_tx_cb_t cb = tx_callback;
 
-        //LOG_INF("Received(RSSI:%ddBm, SNR:%ddBm)", rssi, snr);
-        LOG_HEXDUMP_INF(&receive_data[4], receive_data[1], "Received data");
+    if (cb && frame->tag != LORA_APP_TAG_NONE) {
+        cb(frame->tag, status, airtime);
     }
 }
 
+/*---------------------------------------------------------------------------*/
+/*  Demo producer: periodically queue the "hello, world" frame.              */
+/*---------------------------------------------------------------------------*/
+static void beacon_work_cb(struct k_work * work)
+{
+    if (lora_app_enqueue(TO_ID, send_data, MAX_SEND_DATA_LEN, K_NO_WAIT) < 0) {
+        LOG_WRN("TX queue full: beacon dropped");
+    }
+
+    k_delayed_work_submit(&beacon_work, LORA_APP_BEACON_PERIOD_MS);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Take the next received frame; the caller owns it until released.         */
+/*---------------------------------------------------------------------------*/
+lora_rx_frame_t * lora_app_rx_get(s32_t timeout)
+{
+    return k_fifo_get(&lora_rx_fifo, timeout);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Return a frame buffer to the RX pool.                                    */
+/*---------------------------------------------------------------------------*/
+void lora_app_rx_release(lora_rx_frame_t * frame)
+{
+    k_mem_slab_free(&lora_rx_slab, (void **)&frame);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Let k_poll wait for received frames alongside other events.              */
+/*---------------------------------------------------------------------------*/
+void lora_app_rx_poll_init(struct k_poll_event * event)
+{
+    k_poll_event_init(event, K_POLL_TYPE_FIFO_DATA_AVAILABLE,
+                      K_POLL_MODE_NOTIFY_ONLY, &lora_rx_fifo);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Deliver frames to "cb" on the radio thread instead of the RX FIFO;       */
+/*  NULL goes back to the FIFO.                                              */
+/*---------------------------------------------------------------------------*/
+void lora_app_set_rx_callback(lora_app_rx_cb_t cb)
+{
+    rx_callback = cb;
+}
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-void lora_app_send( void )
+void lora_app_set_reliable(bool enable)
+{
+    reliable = enable;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static bool lora_app_arq_frame(const lora_tx_frame_t * frame)
+{
+    return frame >= arq_frames && frame < &arq_frames[LORA_APP_ARQ_WINDOW];
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Leave the window: acknowledged (status 0) or given up.                   */
+/*---------------------------------------------------------------------------*/
+static void lora_app_arq_release(int i, int status)
+{
+    lora_tx_frame_t * frame = &arq_frames[i];
+
+    if (status == 0) {
+        stats.arq_acked++;
+        stats.goodput_bytes += frame->len;
+        rate_goodput_bytes  += frame->len;
+    }
+    else {
+        stats.arq_failed++;
+    }
+
+    arq_state[i] = ARQ_FREE;
+    lora_app_tx_done(frame, status, frame->airtime);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Whatever is on air but unacknowledged goes out again, within retries.    */
+/*---------------------------------------------------------------------------*/
+static void lora_app_arq_retry(void)
+{
+    int i;
+
+    arq_waiting = false;
+
+    for (i = 0; i < LORA_APP_ARQ_WINDOW; i++) {
+        if (arq_state[i] != ARQ_SENT) {
+            continue;
+        }
+        if (++arq_frames[i].retries > LORA_APP_ARQ_RETRIES) {
+            LOG_WRN("No ACK for seq %u: dropped", arq_frames[i].seq);
+            lora_app_arq_release(i, -ETIMEDOUT);
+        }
+        else {
+            arq_state[i] = ARQ_DUE;
+            stats.arq_retransmissions++;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Selective ACK from "src": release what it covers and resend the gaps     */
+/*  right away rather than waiting for the timeout.                          */
+/*---------------------------------------------------------------------------*/
+static void lora_app_arq_ack(u8_t src, const u8_t * sack, u8_t len)
+{
+    u8_t  last_seq;
+    u32_t window;
+    int   i;
+
+    if (len < LORA_FRAME_SACK_LEN) {
+        return;
+    }
+
+    stats.acks_received++;
+
+    last_seq = sack[0];
+    window   = sys_get_le32(&sack[1]);
+
+    for (i = 0; i < LORA_APP_ARQ_WINDOW; i++) {
+        if (arq_state[i] != ARQ_FREE && arq_frames[i].dst == src &&
+            lora_frame_sack_covers(last_seq, window, arq_frames[i].seq)) {
+            lora_app_arq_release(i, 0);
+        }
+    }
+
+    if (arq_waiting && src == arq_dst) {
+        lora_app_arq_retry();
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Drop corrupt frames, frames for other nodes and duplicates before they   */
+/*  reach a consumer.  ACKs are consumed here, and polls answered.           */
+/*---------------------------------------------------------------------------*/
+static int lora_app_filter(lora_rx_frame_t * frame, int len)
 {
     int ret;
 
-    while (1) {
+    ret = lora_frame_decode(frame->data, len, &frame->hdr);
+
+    lora_hop_rx_update(radio_channel, ret >= 0, frame->rssi, frame->snr);
+
+    if (ret < 0) {
+        stats.rx_bad_frames++;
+        metrics_inc(METRIC_LORA_RX_CRC_ERRORS);
+        trace_event(TRACE_LEVEL__ERROR, TRACE_EV__RX_BAD, 0, 0, len,
+                    frame->rssi, frame->snr);
+        return ret;
+    }
+
+    metrics_observe(METRIC_HIST_LORA_RSSI, frame->rssi);
+    metrics_observe(METRIC_HIST_LORA_SNR, frame->snr);
+
+    /* Any valid frame tells us about the link to its sender */
+    lora_adr_update(frame->hdr.src, frame->rssi, frame->snr,
+                    LORA_FRAME_SF_GET(frame->hdr.flags), frame->timestamp);
+
+    /* Every frame, ACKs included, carries the sender's slot offset */
+    lora_hop_sync(frame->hdr.src, radio_channel,
+                  (frame->hdr.slot == LORA_FRAME_SLOT_NONE) ? UINT32_MAX :
+                  frame->hdr.slot * LORA_FRAME_SLOT_UNIT_MS,
+                  lora_airtime_us(&modem_config, len), frame->timestamp);
+
+    if (frame->hdr.flags & LORA_FRAME_FLAG_ACK) {
+        if (frame->hdr.dst == FROM_ID) {
+            trace_event(TRACE_LEVEL__PACKET, TRACE_EV__ACK, frame->hdr.src,
+                        LORA_FRAME_PAYLOAD(frame->data)[0], frame->hdr.len,
+                        frame->rssi, frame->snr);
+            lora_app_arq_ack(frame->hdr.src, LORA_FRAME_PAYLOAD(frame->data),
+                             frame->hdr.len);
+        }
+        return -ENOMSG;
+    }
+
+    ret = lora_frame_accept(&rx_dedup, &frame->hdr, FROM_ID, 
+                            k_uptime_get_32());
+    if (ret == -ENXIO) {
+        stats.rx_not_for_us++;
+        return ret;
+    }
+
+    /* A resent poll means our ACK was lost: answer duplicates too */
+    if ((frame->hdr.flags & LORA_FRAME_FLAG_POLL) &&
+        frame->hdr.dst == FROM_ID) {
+        ack_pending = true;
+        ack_dst = frame->hdr.src;
+    }
+
+    trace_event(TRACE_LEVEL__PACKET,
+                (ret == -EALREADY) ? TRACE_EV__RX_DUP : TRACE_EV__RX,
+                frame->hdr.src, frame->hdr.seq, frame->hdr.len,
+                frame->rssi, frame->snr);
 
-        k_sleep(5000);
+    if (ret == -EALREADY) {
+        stats.rx_duplicates++;
+        return ret;
+    }
 
-        ret = lora_send(lora_dev, send_data, MAX_SEND_DATA_LEN);
+    if (frame->hdr.flags & LORA_FRAME_FLAG_CODEC) {
+        ret = lora_codec_expand(LORA_FRAME_PAYLOAD(frame->data), frame->hdr.len,
+                                codec_buf, sizeof(codec_buf));
         if (ret < 0) {
-            LOG_ERR("LoRa send failed");
+            stats.rx_bad_frames++;
+            return ret;
+        }
+        memcpy(LORA_FRAME_PAYLOAD(frame->data), codec_buf, ret);
+        frame->hdr.len = ret;
+    }
+
+    if (frame->hdr.flags & LORA_FRAME_FLAG_FRAG) {
+        lora_frag_input(frame->hdr.src, LORA_FRAME_PAYLOAD(frame->data),
+                        frame->hdr.len, frame->timestamp);
+        return -ENOMSG;
+    }
+    return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  A frame received into the scratch buffer, with no pool buffer to hold    */
+/*  it.  Data is dropped unaccepted, so the sender's ACK shows it missing    */
+/*  and it is resent; ACKs are still consumed and polls still answered, or   */
+/*  the ARQ would time out while consumers hold the pool.                    */
+/*---------------------------------------------------------------------------*/
+static void lora_app_filter_scratch(lora_rx_frame_t * frame, int len)
+{
+    /* Bad frames are counted there, ACKs consumed */
+    if (lora_frame_decode(frame->data, len, &frame->hdr) < 0 ||
+        (frame->hdr.flags & LORA_FRAME_FLAG_ACK)) {
+        lora_app_filter(frame, len);
+        return;
+    }
+
+    stats.rx_pool_empty++;
+
+    if ((frame->hdr.flags & LORA_FRAME_FLAG_POLL) &&
+        frame->hdr.dst == FROM_ID) {
+        ack_pending = true;
+        ack_dst = frame->hdr.src;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Listen for up to "timeout" milliseconds.                                 */
+/*---------------------------------------------------------------------------*/
+static int lora_app_receive(s32_t timeout)
+{
+    lora_rx_frame_t * frame;
+    int    len;
+    s16_t  rssi;
+    s8_t   snr;
+    u32_t  now = k_uptime_get_32();
+
+    /* Retune at the end of the hop slot */
+    timeout = MIN((u32_t)timeout, lora_hop_slot_remaining_ms(now));
+
+    if (lora_app_configure(LORA_DIR__RX, lora_hop_channel(now),
+                           lora_adr_datarate(), modem_config.tx_power) < 0) {
+        return -EIO;
+    }
+
+    if (k_mem_slab_alloc(&lora_rx_slab, (void **)&frame, K_NO_WAIT) != 0) {
+        frame = &rx_scratch;
+    }
+
+    stats.rx_windows++;
+
+    lora_power_enter(LORA_POWER__RX);
+
+    lora_prof_arm();
+    len = lora_recv(lora_dev, frame->data, LORA_APP_MAX_FRAME_LEN, timeout, 
+                    &rssi, &snr);
+    if (len >= 0) {
+        lora_prof_recv();
+    }
+
+    /* The driver sleeps the radio once RX completes or times out */
+    lora_power_enter(LORA_POWER__SLEEP);
+
+    if (len < 0) {
+        if (frame != &rx_scratch) {
+            lora_app_rx_release(frame);
+        }
+        if (len == -EAGAIN) {
+            /* Window closed without traffic */
+            return 0;
+        }
+        LOG_ERR("LoRa receive failed");
+        return len;
+    }
+
+    stats.rx_frames++;
+    metrics_inc(METRIC_LORA_RX_FRAMES);
+
+    frame->timestamp = k_uptime_get_32();
+    frame->rssi      = rssi;
+    frame->snr       = snr;
+    frame->len       = len;
+
+    if (frame == &rx_scratch) {
+        lora_app_filter_scratch(frame, len);
+        return len;
+    }
+
+    if (lora_app_filter(frame, len) < 0) {
+        lora_app_rx_release(frame);
+        return len;
+    }
+
+    if (rx_callback) {
+        rx_callback(frame);
+    }
+    else {
+        k_fifo_put(&lora_rx_fifo, frame);
+    }
+
+    return len;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Account the first send of a data frame: ACKs and resends carry no new    */
+/*  enqueue, so they count toward neither latency nor frames/s.              */
+/*---------------------------------------------------------------------------*/
+static void lora_app_tx_latency(u32_t enqueued, u32_t on_air)
+{
+    u32_t latency = k_cyc_to_us_floor32(on_air - enqueued);
+
+    stats.tx_latency_last_us = latency;
+    if (latency > stats.tx_latency_max_us) {
+        stats.tx_latency_max_us = latency;
+    }
+
+    tx_latency_sum += latency;
+    tx_latency_samples++;
+    stats.tx_latency_avg_us = (u32_t)(tx_latency_sum / tx_latency_samples);
+
+    rate_frames++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Recompute frames/sec once per rate window.                               */
+/*---------------------------------------------------------------------------*/
+static void lora_app_tx_rate(void)
+{
+    s64_t elapsed = k_uptime_get() - rate_start;
+
+    if (elapsed < LORA_APP_RATE_WINDOW_MS) {
+        return;
+    }
+
+    stats.tx_rate_mfps = (u32_t)(((u64_t)rate_frames * MSEC_PER_SEC * 1000) /
+                                 elapsed);
+    stats.throughput_bps = (u32_t)(((u64_t)rate_tx_bytes * 8 * MSEC_PER_SEC) /
+                                   elapsed);
+    stats.goodput_bps = (u32_t)(((u64_t)rate_goodput_bytes * 8 * MSEC_PER_SEC) /
+                                elapsed);
+
+    LOG_INF("TX: %u.%03u frames/s, latency avg %uus max %uus",
+            stats.tx_rate_mfps / 1000, stats.tx_rate_mfps % 1000,
+            stats.tx_latency_avg_us, stats.tx_latency_max_us);
+    LOG_INF("TX: throughput %ubps, goodput %ubps", stats.throughput_bps,
+            stats.goodput_bps);
+
+    rate_frames = 0;
+    rate_tx_bytes = 0;
+    rate_goodput_bytes = 0;
+    rate_start += elapsed;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Time on air of a frame carrying "len" payload bytes at the current SF.   */
+/*---------------------------------------------------------------------------*/
+u32_t lora_app_airtime_us(u8_t len)
+{
+    struct lora_modem_config config = modem_config;
+
+    config.datarate = lora_adr_datarate();
+
+    return lora_airtime_us(&config, len + LORA_FRAME_OVERHEAD);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Airtime of a queued frame at the data rate it will be sent with.         */
+/*---------------------------------------------------------------------------*/
+static u32_t lora_app_tx_airtime(lora_tx_frame_t * frame)
+{
+    return lora_app_airtime_us(frame->len);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Milliseconds the frame must wait for duty-cycle budget.                  */
+/*---------------------------------------------------------------------------*/
+static u32_t lora_app_tx_wait(lora_tx_frame_t * frame)
+{
+    u32_t now  = k_uptime_get_32();
+    u32_t wait = lora_duty_wait_ms(lora_app_tx_airtime(frame), now);
+
+    /* Budget, then LBT backoff; the hop slot is picked once both are done */
+    if (wait == 0 && (s32_t)(tx_backoff_until - now) > 0) {
+        wait = tx_backoff_until - now;
+    }
+    if (wait == 0) {
+        wait = lora_hop_tx_wait_ms(now);
+    }
+
+    if (wait != UINT32_MAX) {
+        tx_next_send = now + wait;
+    }
+    return wait;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Listen before talk: -EAGAIN while backing off from a busy channel, and   */
+/*  -EBUSY once the frame has met LORA_LBT_MAX_ATTEMPTS busy channels.       */
+/*---------------------------------------------------------------------------*/
+static int lora_app_lbt(lora_tx_frame_t * frame)
+{
+    u32_t now = k_uptime_get_32();
+    bool  clear;
+
+    if (!LORA_LBT_ENABLED) {
+        return 0;
+    }
+
+    lora_power_enter(LORA_POWER__RX);
+
+    clear = lora_lbt_channel_clear(lora_app_frequency(lora_hop_channel(now)));
+
+    lora_power_enter(LORA_POWER__SLEEP);
+
+    if (clear) {
+        return 0;
+    }
+
+    /* Carrier sense retuned the radio behind the driver's back */
+    direction = LORA_DIR__NONE;
+
+    if (++tx_attempts >= LORA_LBT_MAX_ATTEMPTS) {
+        trace_event(TRACE_LEVEL__ERROR, TRACE_EV__TX_BUSY, frame->dst,
+                    frame->seq, frame->len, 0, 0);
+        lora_lbt_dropped();
+        stats.tx_errors++;
+        return -EBUSY;
+    }
+
+    tx_backoff_until = now + lora_lbt_backoff_ms(tx_attempts,
+                                                 lora_app_tx_airtime(frame));
+    return -EAGAIN;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  One transmission of "frame"; completion is up to lora_app_tx_finish.     */
+/*---------------------------------------------------------------------------*/
+static int lora_app_send(lora_tx_frame_t * frame)
+{
+    struct lora_frame_hdr hdr;
+    struct lora_prof_stamp prof;
+    u32_t now = k_uptime_get_32();
+    u8_t  channel = lora_hop_channel(now);
+    u32_t offset = lora_hop_slot_offset_ms(now);
+    u32_t airtime;
+    u32_t on_air;
+    int   len;
+    int   ret;
+
+    if (lora_app_configure(LORA_DIR__TX, channel, lora_adr_datarate(), 
+                           MIN(lora_adr_tx_power(frame->dst, now),
+                               node_config.tx_power)) < 0) {
+        stats.tx_errors++;
+        return -EIO;
+    }
+
+    hdr.dst   = frame->dst;
+    hdr.src   = FROM_ID;
+    hdr.seq   = frame->seq;
+    hdr.flags = frame->flags | LORA_FRAME_SF_SET(lora_adr_need());
+    hdr.len   = frame->len;
+
+    /* Offset into the slot of "channel", reconfiguration included */
+    if (offset != UINT32_MAX) {
+        offset += k_uptime_get_32() - now;
+    }
+    hdr.slot  = (offset < LORA_HOP_DWELL_MS) ?
+                offset / LORA_FRAME_SLOT_UNIT_MS : LORA_FRAME_SLOT_NONE;
+
+    len = lora_frame_encode(frame->data, sizeof(frame->data), &hdr);
+    if (len < 0) {
+        stats.tx_errors++;
+        return len;
+    }
+
+    airtime = lora_airtime_us(&modem_config, len);
+
+    on_air = k_cycle_get_32();
+
+    lora_power_enter(LORA_POWER__TX);
+
+    lora_prof_arm();
+    lora_prof_stamp(&prof);
+    ret = lora_send(lora_dev, frame->data, len);
+    if (ret == 0) {
+        lora_prof_send(&prof, airtime);
+    }
+
+    lora_power_enter(LORA_POWER__SLEEP);
+    metrics_observe(METRIC_HIST_LORA_SEND_US,
+                    k_cyc_to_us_floor32(k_cycle_get_32() - on_air));
+    if (ret < 0) {
+        LOG_ERR("LoRa send failed");
+        stats.tx_errors++;
+        metrics_inc(METRIC_LORA_TX_ERRORS);
+        trace_event(TRACE_LEVEL__ERROR, TRACE_EV__TX_ERROR, frame->dst,
+                    frame->seq, frame->len, 0, 0);
+        return ret;
+    }
+
+    lora_duty_consume(airtime, k_uptime_get_32());
+    lora_hop_tx_done(channel, airtime, now);
+    lora_adr_tx_done(k_uptime_get_32());
+
+    stats.tx_airtime_ms += airtime / USEC_PER_MSEC;
+    stats.tx_frames++;
+    if (stats.first_tx_ms == 0) {
+        stats.first_tx_ms = k_uptime_get_32();
+        LOG_INF("First frame on air %ums after boot", stats.first_tx_ms);
+    }
+    metrics_inc(METRIC_LORA_TX_FRAMES);
+    stats.tx_bytes += len;
+    rate_tx_bytes  += len;
+
+    frame->airtime += airtime;
+
+    if (frame->retries == 0 && !(frame->flags & LORA_FRAME_FLAG_ACK)) {
+        lora_app_tx_latency(frame->enqueued, on_air);
+    }
+
+    trace_event(TRACE_LEVEL__PACKET, TRACE_EV__TX, frame->dst, frame->seq,
+                frame->len, 0, 0);
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  How long to wait for a selective ACK after a poll: its time on air plus  */
+/*  the peer's turnaround.                                                   */
+/*---------------------------------------------------------------------------*/
+static u32_t lora_app_ack_timeout_ms(void)
+{
+    return lora_app_airtime_us(LORA_FRAME_SACK_LEN) / USEC_PER_MSEC +
+           LORA_APP_ARQ_ACK_MARGIN_MS;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Outcome of one attempt at "frame": plain frames are done either way,     */
+/*  window frames only once acknowledged or out of retries.                  */
+/*---------------------------------------------------------------------------*/
+static void lora_app_tx_finish(lora_tx_frame_t * frame, int ret)
+{
+    int i = frame - arq_frames;
+
+    if (!lora_app_arq_frame(frame)) {
+        if (ret == 0) {
+            stats.goodput_bytes += frame->len;
+            rate_goodput_bytes  += frame->len;
+        }
+        lora_app_tx_done(frame, ret, (ret == 0) ? frame->airtime : 0);
+        return;
+    }
+
+    if (ret == -EMSGSIZE || ret == -EINVAL || ret == -EBUSY) {
+        /* Can never go out, or LBT gave up */
+        lora_app_arq_release(i, ret);
+        return;
+    }
+
+    if (ret < 0) {
+        /* Radio error: try again */
+        if (++frame->retries > LORA_APP_ARQ_RETRIES) {
+            lora_app_arq_release(i, ret);
+        }
+        return;
+    }
+
+    arq_state[i] = ARQ_SENT;
+
+    if (frame->flags & LORA_FRAME_FLAG_POLL) {
+        arq_waiting  = true;
+        arq_deadline = k_uptime_get_32() + lora_app_ack_timeout_ms();
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Answer a poll with the duplicate filter's view of the peer.  The ACK     */
+/*  skips LBT, since the poller has just left the channel to us, and is     */
+/*  dropped rather than delayed when out of duty-cycle budget.               */
+/*---------------------------------------------------------------------------*/
+static int lora_app_send_ack(void)
+{
+    u8_t * sack = LORA_FRAME_PAYLOAD(ack_frame.data);
+    u8_t   last_seq;
+    u32_t  window;
+    int    ret;
+
+    ack_pending = false;
+
+    if (lora_frame_sack_get(&rx_dedup, ack_dst, &last_seq, &window) < 0) {
+        return 0;
+    }
+
+    ack_frame.enqueued = k_cycle_get_32();
+    ack_frame.airtime  = 0;
+    ack_frame.tag      = LORA_APP_TAG_NONE;
+    ack_frame.dst      = ack_dst;
+    ack_frame.len      = LORA_FRAME_SACK_LEN;
+    ack_frame.seq      = 0;
+    ack_frame.flags    = LORA_FRAME_FLAG_ACK;
+    ack_frame.retries  = 0;
+
+    sack[0] = last_seq;
+    sys_put_le32(window, &sack[1]);
+
+    if (lora_duty_wait_ms(lora_app_tx_airtime(&ack_frame),
+                          k_uptime_get_32()) != 0) {
+        stats.tx_duty_deferred++;
+        return 0;
+    }
+
+    ret = lora_app_send(&ack_frame);
+    if (ret == 0) {
+        stats.acks_sent++;
+    }
+    return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Move reliable unicast frames from the queue into free window entries,    */
+/*  as long as they go to the peer the window already serves.                */
+/*---------------------------------------------------------------------------*/
+static void lora_app_arq_fill(void)
+{
+    lora_tx_frame_t * frame;
+    bool  empty = true;
+    int   free = -1;
+    int   i;
+
+    for (i = 0; i < LORA_APP_ARQ_WINDOW; i++) {
+        if (arq_state[i] != ARQ_FREE) {
+            empty = false;
+        }
+    }
+
+    while (reliable) {
+
+        for (free = -1, i = 0; i < LORA_APP_ARQ_WINDOW; i++) {
+            if (arq_state[i] == ARQ_FREE) {
+                free = i;
+                break;
+            }
+        }
+
+        if (free < 0) {
             return;
         }
 
-        LOG_INF("Data sent!");
+        frame = &arq_frames[free];
+
+        /* Peek: the frame stays queued unless it may join the window */
+        if (k_msgq_peek(&lora_tx_queue, frame) != 0 ||
+            frame->dst == LORA_FRAME_BROADCAST ||
+            (!empty && frame->dst != arq_dst)) {
+            return;
+        }
+
+        k_msgq_get(&lora_tx_queue, frame, K_NO_WAIT);
+
+        frame->airtime = 0;
+        frame->seq     = tx_seq++;
+        frame->retries = 0;
+
+        arq_state[free] = ARQ_DUE;
+        arq_dst = frame->dst;
+        empty = false;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Pick the frame to send next, or NULL to listen.  Window frames go out    */
+/*  oldest first, back to back, and the last of a burst carries POLL.        */
+/*---------------------------------------------------------------------------*/
+static lora_tx_frame_t * lora_app_tx_next(void)
+{
+    lora_tx_frame_t * frame = NULL;
+    bool  sent = false;
+    int   due = 0;
+    int   i;
+
+    if (tx_pending) {
+        return tx_current;
+    }
+
+    if (arq_waiting) {
+        if ((s32_t)(k_uptime_get_32() - arq_deadline) < 0) {
+            return NULL;
+        }
+        stats.arq_timeouts++;
+        lora_app_arq_retry();
+    }
+
+    lora_app_arq_fill();
+
+    for (i = 0; i < LORA_APP_ARQ_WINDOW; i++) {
+        if (arq_state[i] == ARQ_SENT) {
+            sent = true;
+        }
+        if (arq_state[i] != ARQ_DUE) {
+            continue;
+        }
+        due++;
+        if (!frame || (s8_t)(arq_frames[i].seq - frame->seq) < 0) {
+            frame = &arq_frames[i];
+        }
+    }
+
+    if (frame) {
+        if (due == 1) {
+            frame->flags |= LORA_FRAME_FLAG_POLL;
+        }
+        else {
+            frame->flags &= ~LORA_FRAME_FLAG_POLL;
+        }
+    }
+    else if (sent) {
+        /* The poll itself was lost to LBT or the duty cycle: poll again */
+        lora_app_arq_retry();
+        return lora_app_tx_next();
+    }
+    else if (k_msgq_get(&lora_tx_queue, &tx_frame, K_NO_WAIT) == 0) {
+        frame = &tx_frame;
+        frame->airtime = 0;
+        frame->seq     = tx_seq++;
+        frame->retries = 0;
+    }
+    else {
+        return NULL;
+    }
+
+    tx_current  = frame;
+    tx_pending  = true;
+    tx_attempts = 0;
+    return frame;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_app_set_power_mode(lora_app_power_t mode)
+{
+    power_mode = mode;
+
+    tx_wake_at = k_cycle_get_32();
+    k_sem_give(&tx_wake);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Low-power idle: leave the radio asleep (the driver put it there) and    */
+/*  let the kernel idle tickless until the sleep ends or a frame is queued. */
+/*---------------------------------------------------------------------------*/
+static void lora_app_sleep(void)
+{
+    u32_t start = k_cycle_get_32();
+    u32_t woken;
+    u32_t latency;
+
+    /* Clear stale wakes first, so an enqueue after the check still counts */
+    k_sem_reset(&tx_wake);
+
+    if (k_msgq_num_used_get(&lora_tx_queue) != 0) {
+        return;
+    }
+
+    stats.sleeps++;
+    trace_event(TRACE_LEVEL__ALL, TRACE_EV__SLEEP, 0, 0, 0, 0, 0);
+
+    if (k_sem_take(&tx_wake, K_MSEC(LORA_APP_SLEEP_MS)) == 0) {
+        woken = tx_wake_at;
+        stats.sleep_wakes_early++;
+    }
+    else {
+        woken = start + k_ms_to_cyc_ceil32(LORA_APP_SLEEP_MS);
+    }
+
+    latency = k_cyc_to_us_floor32(k_cycle_get_32() - woken);
+    trace_event(TRACE_LEVEL__ALL, TRACE_EV__WAKE, 0, 0, 0, 0, 0);
+
+    stats.wake_latency_last_us = latency;
+    if (latency > stats.wake_latency_max_us) {
+        stats.wake_latency_max_us = latency;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Keep the radio alive: after a failed config, send or receive, force a    */
+/*  full reconfigure on the next pass and back off while errors persist.    */
+/*---------------------------------------------------------------------------*/
+static void lora_app_recover(int ret)
+{
+    if (ret >= 0) {
+        retry_ms = 0;
+        return;
+    }
+
+    stats.radio_errors++;
+
+    retry_ms = retry_ms ? MIN(retry_ms * 2, LORA_APP_RETRY_MAX_MS)
+                        : LORA_APP_RETRY_MIN_MS;
+
+    LOG_WRN("Radio error %d: re-arming in %ums", ret, retry_ms);
+
+    direction = LORA_DIR__NONE;
+    k_sleep(K_MSEC(retry_ms));
+
+    stats.radio_recoveries++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Half-duplex radio scheduler: drain the TX queue back-to-back as far as   */
+/*  the duty-cycle budget allows, and listen whenever there is nothing to    */
+/*  send or the next frame is waiting for budget.                            */
+/*---------------------------------------------------------------------------*/
+void lora_app_run(void)
+{
+    lora_tx_frame_t * frame;
+    u32_t wait;
+    s32_t remaining;
+    int   ret;
+
+    LOG_INF("Radio scheduler started");
+
+    rate_start = k_uptime_get();
+
+    k_delayed_work_init(&beacon_work, beacon_work_cb);
+    k_delayed_work_submit(&beacon_work, LORA_APP_BEACON_PERIOD_MS);
+
+    while (1) {
+
+        if (ack_pending) {
+            ret = lora_app_send_ack();
+        }
+        else if ((frame = lora_app_tx_next()) != NULL) {
+            wait = lora_app_tx_wait(frame);
+
+            if (wait == 0) {
+                ret = lora_app_lbt(frame);
+                if (ret == 0) {
+                    ret = lora_app_send(frame);
+                }
+
+                if (ret == -EAGAIN) {
+                    /* Busy channel: backing off */
+                    ret = 0;
+                }
+                else {
+                    tx_pending = false;
+                    lora_app_tx_finish(frame, ret);
+                    if (ret == -EBUSY) {
+                        ret = 0;
+                    }
+                }
+            }
+            else if (wait == UINT32_MAX) {
+                LOG_ERR("Frame exceeds duty-cycle burst: dropped");
+                stats.tx_errors++;
+                tx_pending = false;
+                lora_app_tx_finish(frame, -EMSGSIZE);
+                ret = 0;
+            }
+            else {
+                stats.tx_duty_deferred++;
+                ret = lora_app_receive(MIN(wait, LORA_APP_RX_WINDOW_MS));
+            }
+        }
+        else if (arq_waiting) {
+            /* Listen for the ACK until it is due */
+            remaining = arq_deadline - k_uptime_get_32();
+            ret = lora_app_receive(MAX(MIN(remaining, LORA_APP_RX_WINDOW_MS), 1));
+        }
+        else {
+            ret = lora_app_receive(LORA_APP_RX_WINDOW_MS);
+
+            /* Stay awake while traffic is arriving */
+            if (power_mode == LORA_APP_POWER__LOW && ret == 0) {
+                lora_app_sleep();
+            }
+        }
+
+        /* A frame that failed to encode is the caller's fault, not the radio's */
+        if (ret != -EMSGSIZE && ret != -EINVAL) {
+            lora_app_recover(ret);
+        }
+
+        lora_app_tx_rate();
+        lora_adr_tick(k_uptime_get_32());
+        lora_frag_tick(k_uptime_get_32());
     }
 }
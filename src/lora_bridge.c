@@ -0,0 +1,278 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/atomic.h>
+#include <sys/byteorder.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "ble_base.h"
+#include "ble_policy.h"
+#include "lora_bridge.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_bridge);
+
+#define BRIDGE_PDU_MAX   (BLE_ATT_MTU - 3)
+
+/* Frames from the radio thread; bridge_count bounds the FIFO */
+K_FIFO_DEFINE(bridge_fifo);
+static atomic_t bridge_count;
+
+/* Raised by bridge_retry_timer; the FIFO event is ignored while waiting */
+static struct k_poll_signal bridge_retry;
+static struct k_timer bridge_retry_timer;
+static struct k_poll_event * bridge_events;
+static bool bridge_waiting;
+
+/* Notification being packed */
+static u8_t  bridge_pdu[BRIDGE_PDU_MAX];
+static u16_t bridge_used;
+static u8_t  bridge_id;
+
+/* Frame being chunked into bridge_pdu */
+static u8_t  bridge_frame[LORA_BRIDGE_META_LEN + LORA_FRAME_MAX_PAYLOAD];
+static u16_t frame_total;
+static u16_t frame_offset;
+static u16_t frag_chunk;
+static u16_t frag_room;
+static u8_t  frag_index;
+static u8_t  frag_count;
+
+static struct lora_bridge_stats stats;
+
+/*---------------------------------------------------------------------------*/
+/*  Hand a received frame to the bridge, which releases it.  Called on the   */
+/*  radio thread; never blocks.                                              */
+/*---------------------------------------------------------------------------*/
+int lora_bridge_forward(lora_rx_frame_t * frame)
+{
+    lora_rx_frame_t * oldest;
+
+    if (!paste_lora_subscribed()) {
+        lora_app_rx_release(frame);
+        return -ENOTCONN;
+    }
+
+    if (atomic_get(&bridge_count) >= LORA_BRIDGE_QUEUE_DEPTH) {
+        oldest = k_fifo_get(&bridge_fifo, K_NO_WAIT);
+        if (oldest) {
+            atomic_dec(&bridge_count);
+            lora_app_rx_release(oldest);
+            stats.evicted++;
+        }
+    }
+
+    atomic_inc(&bridge_count);
+    k_fifo_put(&bridge_fifo, frame);
+
+    stats.frames++;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void bridge_retry_expiry(struct k_timer * timer)
+{
+    k_poll_signal_raise(&bridge_retry, 0);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Events for the application loop: a frame queued, or a retry due.         */
+/*---------------------------------------------------------------------------*/
+void lora_bridge_poll_init(struct k_poll_event * events)
+{
+    k_poll_signal_init(&bridge_retry);
+    k_timer_init(&bridge_retry_timer, bridge_retry_expiry, NULL);
+
+    bridge_events = events;
+
+    k_poll_event_init(&events[0], K_POLL_TYPE_FIFO_DATA_AVAILABLE,
+                      K_POLL_MODE_NOTIFY_ONLY, &bridge_fifo);
+    k_poll_event_init(&events[1], K_POLL_TYPE_SIGNAL,
+                      K_POLL_MODE_NOTIFY_ONLY, &bridge_retry);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  While a retry is due, stop waking on queued frames: they would keep the  */
+/*  FIFO event ready and spin the loop.  The FIFO stays attached: the        */
+/*  kernel asserts on a NULL object, even for K_POLL_TYPE_IGNORE.            */
+/*---------------------------------------------------------------------------*/
+static void bridge_wait(bool wait)
+{
+    bridge_waiting = wait;
+
+    if (wait) {
+        k_poll_event_init(&bridge_events[0], K_POLL_TYPE_IGNORE,
+                          K_POLL_MODE_NOTIFY_ONLY, &bridge_fifo);
+        k_timer_start(&bridge_retry_timer, K_MSEC(LORA_BRIDGE_RETRY_MS), 0);
+    }
+    else {
+        k_poll_event_init(&bridge_events[0], K_POLL_TYPE_FIFO_DATA_AVAILABLE,
+                          K_POLL_MODE_NOTIFY_ONLY, &bridge_fifo);
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Usable notification payload on the current connection.                   */
+/*---------------------------------------------------------------------------*/
+static u16_t bridge_room(void)
+{
+    return MIN(ble_get_mtu() - 3, BRIDGE_PDU_MAX);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Send the packed notification.  Returns -ENOMEM, keeping it for a retry,  */
+/*  when the stack is out of TX buffers.                                     */
+/*---------------------------------------------------------------------------*/
+static int bridge_push(void)
+{
+    int rc;
+
+    if (bridge_used == 0) {
+        return 0;
+    }
+
+    rc = paste_lora_notify(bridge_pdu, bridge_used);
+    if (rc == -ENOMEM) {
+        stats.retries++;
+        bridge_wait(true);
+        return rc;
+    }
+
+    if (rc == 0) {
+        stats.packets++;
+    }
+    else {
+        LOG_WRN("%s: notify error %d", __func__, rc);
+        stats.dropped++;
+    }
+
+    bridge_used = 0;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Serialize the frame into bridge_frame and plan its chunks.               */
+/*---------------------------------------------------------------------------*/
+static void bridge_start(lora_rx_frame_t * frame)
+{
+    bridge_frame[0] = frame->hdr.src;
+    bridge_frame[1] = frame->hdr.dst;
+    bridge_frame[2] = frame->hdr.seq;
+    bridge_frame[3] = frame->hdr.flags;
+    sys_put_le16(frame->rssi, &bridge_frame[4]);
+    bridge_frame[6] = frame->snr;
+    bridge_frame[7] = frame->hdr.len;
+    memcpy(&bridge_frame[LORA_BRIDGE_META_LEN],
+           LORA_FRAME_PAYLOAD(frame->data), frame->hdr.len);
+
+    frame_total  = LORA_BRIDGE_META_LEN + frame->hdr.len;
+    frame_offset = 0;
+    frag_index   = 0;
+    frag_room    = bridge_room();
+
+    lora_app_rx_release(frame);
+
+    bridge_id++;
+
+    if (LORA_BRIDGE_RECORD_HDR + frame_total <= frag_room) {
+        frag_chunk = frame_total;
+        frag_count = 1;
+        return;
+    }
+
+    frag_chunk = frag_room - LORA_BRIDGE_RECORD_HDR;
+    frag_count = (frame_total + frag_chunk - 1) / frag_chunk;
+    if (frag_count > 16) {
+        LOG_WRN("%s: MTU %u too small for %u bytes", __func__,
+                frag_room + 3, frame_total);
+        stats.dropped++;
+        frag_count = 0;
+        return;
+    }
+
+    stats.fragmented++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Append the next chunk of the current frame: a whole small frame packs    */
+/*  after what is pending, a fragment always fills a notification of its    */
+/*  own.  Returns false when the pending notification must go out first.    */
+/*---------------------------------------------------------------------------*/
+static bool bridge_step(void)
+{
+    u16_t  size = MIN(frag_chunk, frame_total - frame_offset);
+    u8_t * record = &bridge_pdu[bridge_used];
+
+    if (bridge_used + LORA_BRIDGE_RECORD_HDR + size > frag_room) {
+        return false;
+    }
+
+    record[0] = bridge_id;
+    record[1] = (frag_index << 4) | (frag_count - 1);
+    record[2] = size;
+    memcpy(&record[LORA_BRIDGE_RECORD_HDR], &bridge_frame[frame_offset], size);
+
+    bridge_used  += LORA_BRIDGE_RECORD_HDR + size;
+    frame_offset += size;
+    frag_index++;
+
+    return true;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Pack and send whatever is queued.  Called from the event loop when      */
+/*  either bridge event fires; returns early while waiting on a retry.      */
+/*---------------------------------------------------------------------------*/
+void lora_bridge_service(void)
+{
+    lora_rx_frame_t * frame;
+    unsigned int signaled;
+    int result;
+
+    k_poll_signal_check(&bridge_retry, &signaled, &result);
+    k_poll_signal_reset(&bridge_retry);
+
+    if (bridge_waiting) {
+        if (!signaled) {
+            return;
+        }
+        bridge_wait(false);
+    }
+
+    while (1) {
+
+        if (frag_index < frag_count) {
+            if (!bridge_step() && bridge_push() < 0) {
+                return;
+            }
+            continue;
+        }
+
+        frame = k_fifo_get(&bridge_fifo, K_NO_WAIT);
+        if (!frame) {
+            break;
+        }
+        atomic_dec(&bridge_count);
+
+        bridge_start(frame);
+    }
+
+    bridge_push();
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_bridge_get_stats(struct lora_bridge_stats * out)
+{
+    *out = stats;
+}
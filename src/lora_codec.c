@@ -0,0 +1,403 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "lora_codec.h"
+#include "lora_prof.h"
+#include "bench.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_codec);
+
+/*---------------------------------------------------------------------------*/
+/*  Dictionary coder tokens                                                  */
+/*                                                                           */
+/*    0x00-0x7F   literal byte                                               */
+/*    0x80-0xFE   dictionary entry (token - 0x80)                            */
+/*    0xFF        escape: the next byte is a literal 0x80-0xFF               */
+/*---------------------------------------------------------------------------*/
+#define TOKEN_DICT      0x80
+#define TOKEN_ESCAPE    0xFF
+
+/* Longest entries first would not matter: matching takes the longest */
+static const char * const dictionary[] = {
+    "hello", "world", ", ", "node", "dist", "rssi", "snr", "batt", "temp",
+    "time", "seq", "tqf", "id=", "ok", "err", "\r\n", "  ", "00", "0.",
+};
+
+BUILD_ASSERT(ARRAY_SIZE(dictionary) <= TOKEN_ESCAPE - TOKEN_DICT);
+
+static struct lora_codec_stats stats;
+static u64_t encode_cycles;     // DWT CPU cycles, see lora_prof.h
+static u64_t decode_cycles;
+
+/*---------------------------------------------------------------------------*/
+/*  Unsigned LEB128.  Returns the bytes written, or -EMSGSIZE.               */
+/*---------------------------------------------------------------------------*/
+int lora_codec_varint_put(u8_t * buf, size_t size, u32_t value)
+{
+    size_t n = 0;
+
+    do {
+        if (n == size) {
+            return -EMSGSIZE;
+        }
+        buf[n++] = (value & 0x7F) | ((value > 0x7F) ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+
+    return n;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Returns the bytes read, or -EBADMSG if truncated or over 32 bits.        */
+/*---------------------------------------------------------------------------*/
+int lora_codec_varint_get(const u8_t * buf, size_t len, u32_t * value)
+{
+    u32_t  result = 0;
+    size_t n;
+
+    for (n = 0; n < len && n < 5; n++) {
+        result |= (u32_t)(buf[n] & 0x7F) << (7 * n);
+        if (!(buf[n] & 0x80)) {
+            *value = result;
+            return n + 1;
+        }
+    }
+
+    return -EBADMSG;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Report: [count] then per node [id delta (zigzag)][dist (scaled)][tqf].   */
+/*---------------------------------------------------------------------------*/
+int lora_codec_reps_encode(const ble_reps_t * reps, u8_t * buf, size_t size)
+{
+    const ble_rep_t * rep;
+    u16_t  prev_id = 0;
+    float  scaled;
+    u32_t  dist;
+    size_t n = 0;
+    int    ret;
+    int    i;
+
+    if (reps->cnt > ARRAY_SIZE(reps->ble_rep) || size < 1) {
+        return -EINVAL;
+    }
+
+    buf[n++] = reps->cnt;
+
+    for (i = 0; i < reps->cnt; i++) {
+        rep = &reps->ble_rep[i];
+
+        ret = lora_codec_varint_put(&buf[n], size - n,
+                          lora_codec_zigzag((s32_t)rep->node_id - prev_id));
+        if (ret < 0) {
+            return ret;
+        }
+        n += ret;
+        prev_id = rep->node_id;
+
+        /* Negative and NaN distances read as 0, huge ones saturate */
+        scaled = rep->dist * LORA_CODEC_DIST_SCALE + 0.5f;
+        if (!(scaled > 0.0f)) {
+            dist = 0;
+        }
+        else if (scaled >= 4294967040.0f) {
+            dist = UINT32_MAX;
+        }
+        else {
+            dist = (u32_t)scaled;
+        }
+
+        ret = lora_codec_varint_put(&buf[n], size - n, dist);
+        if (ret < 0) {
+            return ret;
+        }
+        n += ret;
+
+        if (n == size) {
+            return -EMSGSIZE;
+        }
+        buf[n++] = rep->tqf;
+    }
+
+    return n;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int lora_codec_reps_decode(const u8_t * buf, size_t len, ble_reps_t * reps)
+{
+    ble_rep_t * rep;
+    u16_t  prev_id = 0;
+    u32_t  value;
+    size_t n = 0;
+    int    ret;
+    int    i;
+
+    if (len < 1 || buf[0] > ARRAY_SIZE(reps->ble_rep)) {
+        return -EBADMSG;
+    }
+
+    reps->cnt = buf[n++];
+
+    for (i = 0; i < reps->cnt; i++) {
+        rep = &reps->ble_rep[i];
+
+        ret = lora_codec_varint_get(&buf[n], len - n, &value);
+        if (ret < 0) {
+            return ret;
+        }
+        n += ret;
+        rep->node_id = prev_id + lora_codec_unzigzag(value);
+        prev_id = rep->node_id;
+
+        ret = lora_codec_varint_get(&buf[n], len - n, &value);
+        if (ret < 0) {
+            return ret;
+        }
+        n += ret;
+        rep->dist = (float)value / LORA_CODEC_DIST_SCALE;
+
+        if (n == len) {
+            return -EBADMSG;
+        }
+        rep->tqf = buf[n++];
+    }
+
+    return n;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Longest dictionary entry at the start of "in", or -1.                    */
+/*---------------------------------------------------------------------------*/
+static int codec_match(const u8_t * in, size_t len, size_t * match_len)
+{
+    size_t entry_len;
+    int    best = -1;
+    int    i;
+
+    *match_len = 0;
+
+    for (i = 0; i < ARRAY_SIZE(dictionary); i++) {
+        entry_len = strlen(dictionary[i]);
+        if (entry_len > *match_len && entry_len <= len &&
+            memcmp(in, dictionary[i], entry_len) == 0) {
+            best = i;
+            *match_len = entry_len;
+        }
+    }
+
+    return best;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Dictionary-code "in".  Returns the coded length, or -EMSGSIZE when it   */
+/*  would not be shorter than "size" (pass len - 1 to require a gain).       */
+/*---------------------------------------------------------------------------*/
+int lora_codec_compress(const u8_t * in, u8_t len, u8_t * out, size_t size)
+{
+    struct lora_prof_stamp start;
+    struct lora_prof_stamp end;
+    size_t match_len;
+    size_t i = 0;
+    size_t n = 0;
+    int    entry;
+    int    ret;
+    int    key;
+
+    lora_prof_stamp(&start);
+
+    while (i < len) {
+
+        entry = codec_match(&in[i], len - i, &match_len);
+
+        if (entry >= 0) {
+            if (n == size) {
+                break;
+            }
+            out[n++] = TOKEN_DICT + entry;
+            i += match_len;
+            continue;
+        }
+
+        if (in[i] >= TOKEN_DICT) {
+            if (n == size) {
+                break;
+            }
+            out[n++] = TOKEN_ESCAPE;
+        }
+
+        if (n == size) {
+            break;
+        }
+        out[n++] = in[i++];
+    }
+
+    ret = (i < len) ? -EMSGSIZE : (int)n;
+
+    lora_prof_stamp(&end);
+
+    key = irq_lock();
+    stats.frames++;
+    stats.bytes_in += len;
+    if (ret > 0 && ret < len) {
+        stats.compressed++;
+        stats.bytes_out += ret;
+    }
+    else {
+        stats.bytes_out += len;
+    }
+    encode_cycles += end.cpu - start.cpu;
+    irq_unlock(key);
+
+    return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Inverse of lora_codec_compress.  Returns the expanded length, or         */
+/*  -EBADMSG / -EMSGSIZE.                                                    */
+/*---------------------------------------------------------------------------*/
+int lora_codec_expand(const u8_t * in, u8_t len, u8_t * out, size_t size)
+{
+    struct lora_prof_stamp start;
+    struct lora_prof_stamp end;
+    size_t entry_len;
+    size_t i = 0;
+    size_t n = 0;
+    int    ret = 0;
+    int    key;
+
+    lora_prof_stamp(&start);
+
+    while (i < len && ret == 0) {
+
+        if (in[i] == TOKEN_ESCAPE) {
+            if (i + 1 == len) {
+                ret = -EBADMSG;
+            }
+            else if (n == size) {
+                ret = -EMSGSIZE;
+            }
+            else {
+                out[n++] = in[i + 1];
+                i += 2;
+            }
+        }
+        else if (in[i] >= TOKEN_DICT) {
+            if (in[i] - TOKEN_DICT >= ARRAY_SIZE(dictionary)) {
+                ret = -EBADMSG;
+                break;
+            }
+            entry_len = strlen(dictionary[in[i] - TOKEN_DICT]);
+            if (n + entry_len > size) {
+                ret = -EMSGSIZE;
+            }
+            else {
+                memcpy(&out[n], dictionary[in[i] - TOKEN_DICT], entry_len);
+                n += entry_len;
+                i++;
+            }
+        }
+        else if (n == size) {
+            ret = -EMSGSIZE;
+        }
+        else {
+            out[n++] = in[i++];
+        }
+    }
+
+    lora_prof_stamp(&end);
+
+    key = irq_lock();
+    if (ret < 0) {
+        stats.decode_errors++;
+    }
+    else {
+        stats.decoded++;
+        decode_cycles += end.cpu - start.cpu;
+    }
+    irq_unlock(key);
+
+    return (ret < 0) ? ret : (int)n;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_codec_get_stats(struct lora_codec_stats * out)
+{
+    int key = irq_lock();
+
+    *out = stats;
+    out->encode_cycles = stats.frames ?
+                         (u32_t)(encode_cycles / stats.frames) : 0;
+    out->decode_cycles = stats.decoded ?
+                         (u32_t)(decode_cycles / stats.decoded) : 0;
+
+    irq_unlock(key);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Sizes and host CPU time for a ten node report and the demo beacon.       */
+/*---------------------------------------------------------------------------*/
+void lora_codec_bench(u32_t iterations)
+{
+    static const u8_t text[] = "hello, world";
+    ble_reps_t reps;
+    ble_reps_t decoded;
+    u8_t  buf[LORA_CODEC_REPS_MAX_LEN];
+    u8_t  plain[sizeof(text)];
+    u64_t start;
+    u64_t reps_ns;
+    u64_t text_ns;
+    int   reps_len = 0;
+    int   text_len = 0;
+    u32_t i;
+
+    if (iterations == 0) {
+        return;
+    }
+
+    reps.cnt = ARRAY_SIZE(reps.ble_rep);
+    for (i = 0; i < reps.cnt; i++) {
+        reps.ble_rep[i].node_id = 0x0100 + i * 3;
+        reps.ble_rep[i].dist    = 1.25f + i * 2.5f;
+        reps.ble_rep[i].tqf     = 200 - i;
+    }
+
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++) {
+        reps_len = lora_codec_reps_encode(&reps, buf, sizeof(buf));
+        lora_codec_reps_decode(buf, reps_len, &decoded);
+    }
+    reps_ns = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++) {
+        text_len = lora_codec_compress(text, sizeof(text) - 1, buf,
+                                       sizeof(text) - 2);
+        lora_codec_expand(buf, text_len, plain, sizeof(plain));
+    }
+    text_ns = bench_now_ns() - start;
+
+    LOG_INF("codec bench: report %uB -> %dB, %uns/frame; text %uB -> %dB, "
+            "%uns/frame", (u32_t)sizeof(reps), reps_len,
+            (u32_t)(reps_ns / iterations), (u32_t)(sizeof(text) - 1), text_len,
+            (u32_t)(text_ns / iterations));
+
+    /* The runs above are not traffic */
+    memset(&stats, 0, sizeof(stats));
+    encode_cycles = 0;
+    decode_cycles = 0;
+}
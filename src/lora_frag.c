@@ -0,0 +1,287 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "lora_adr.h"
+#include "lora_airtime.h"
+#include "lora_app.h"
+#include "lora_frag.h"
+#include "lora_frame.h"
+#include "lora_hop.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_frag);
+
+#define FRAG_MAX_CHUNK      (LORA_FRAME_MAX_PAYLOAD - LORA_FRAG_HDR_LEN)
+#define FRAG_MAX_COUNT      UINT8_MAX
+
+K_MEM_SLAB_DEFINE(lora_frag_slab, LORA_FRAG_MAX_LEN, LORA_FRAG_POOL, 4);
+
+struct frag_entry {
+    u8_t * buf;             // NULL when the entry is free
+    u32_t  last_seen;
+    u32_t  received[(FRAG_MAX_COUNT + 31) / 32];   // bitmap by index
+    u16_t  len;             // known once the last fragment is in
+    u8_t   src;
+    u8_t   msg_id;
+    u8_t   count;
+    u8_t   size;
+    u8_t   have;            // fragments received
+};
+
+static struct frag_entry entries[LORA_FRAG_POOL];
+
+static u8_t tx_msg_id;
+
+static lora_frag_rx_cb_t rx_callback;
+
+static struct lora_frag_stats stats;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_frag_init(void)
+{
+    memset(entries, 0, sizeof(entries));
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Chunk size giving the least total time on air for a "len" byte message:  */
+/*  airtime grows in steps of whole coding blocks, so the largest chunk is   */
+/*  not always best.  A fragment must fit the duty-cycle bucket and, when    */
+/*  hopping, a slot.  Returns 0 when no size fits (SF11/12 while hopping).   */
+/*---------------------------------------------------------------------------*/
+u8_t lora_frag_size(u16_t len)
+{
+    u32_t best_us = UINT32_MAX;
+    u8_t  best = 0;
+    u32_t full_us;
+    u32_t total_us;
+    u32_t count;
+    u32_t size;
+
+    for (size = FRAG_MAX_CHUNK; size > 0; size--) {
+
+        count = (len + size - 1) / size;
+        if (count > FRAG_MAX_COUNT) {
+            break;
+        }
+
+        full_us = lora_app_airtime_us(LORA_FRAG_HDR_LEN + size);
+
+        if (LORA_DUTY_CYCLE_PERMILLE > 0 && full_us > LORA_DUTY_BURST_US) {
+            continue;
+        }
+
+        if (lora_hop_enabled() &&
+            full_us / USEC_PER_MSEC + LORA_HOP_GUARD_MS > LORA_HOP_DWELL_MS) {
+            continue;
+        }
+
+        total_us = (count - 1) * full_us +
+                   lora_app_airtime_us(LORA_FRAG_HDR_LEN + len - (count - 1) * size);
+
+        if (total_us < best_us) {
+            best_us = total_us;
+            best = size;
+        }
+    }
+
+    return best;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Queue "msg" as fragments to "dst".  Blocks up to "timeout" per fragment  */
+/*  for queue space; a message cut short is evicted by the receiver.         */
+/*  -EMSGSIZE when no fragment fits the current SF's airtime limits.         */
+/*---------------------------------------------------------------------------*/
+int lora_frag_send(u8_t dst, const u8_t * msg, u16_t len, s32_t timeout)
+{
+    u8_t  fragment[LORA_FRAG_HDR_LEN + FRAG_MAX_CHUNK];
+    u8_t  size;
+    u8_t  count;
+    u16_t chunk;
+    int   index;
+    int   ret;
+
+    if (len == 0 || len > LORA_FRAG_MAX_LEN) {
+        return -EINVAL;
+    }
+
+    size = lora_frag_size(len);
+    if (size == 0) {
+        LOG_WRN("No fragment size fits at SF%u", lora_adr_datarate());
+        return -EMSGSIZE;
+    }
+
+    count = (len + size - 1) / size;
+
+    fragment[0] = tx_msg_id++;
+    fragment[2] = count;
+    fragment[3] = size;
+
+    LOG_DBG("%u bytes to %u: %u fragments of %u", len, dst, count, size);
+
+    for (index = 0; index < count; index++) {
+
+        chunk = MIN(size, len - index * size);
+
+        fragment[1] = index;
+        memcpy(&fragment[LORA_FRAG_HDR_LEN], &msg[index * size], chunk);
+
+        ret = lora_app_enqueue_flags(dst, fragment, LORA_FRAG_HDR_LEN + chunk,
+                                     LORA_APP_TAG_NONE, LORA_FRAME_FLAG_FRAG,
+                                     timeout);
+        if (ret < 0) {
+            return ret;
+        }
+        stats.tx_fragments++;
+    }
+
+    stats.tx_messages++;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_frag_set_rx_callback(lora_frag_rx_cb_t cb)
+{
+    rx_callback = cb;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void frag_release(struct frag_entry * entry)
+{
+    k_mem_slab_free(&lora_frag_slab, (void **)&entry->buf);
+    entry->buf = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Entry for (src, msg_id): the one in progress, else a new one.  Stale     */
+/*  entries are evicted first, so a lost message frees its buffer.           */
+/*---------------------------------------------------------------------------*/
+static struct frag_entry * frag_entry(u8_t src, const u8_t * hdr, u32_t now)
+{
+    struct frag_entry * entry = NULL;
+    int i;
+
+    lora_frag_tick(now);
+
+    for (i = 0; i < LORA_FRAG_POOL; i++) {
+        if (entries[i].buf && entries[i].src == src &&
+            entries[i].msg_id == hdr[0]) {
+            return &entries[i];
+        }
+        if (!entries[i].buf && !entry) {
+            entry = &entries[i];
+        }
+    }
+
+    if (!entry ||
+        k_mem_slab_alloc(&lora_frag_slab, (void **)&entry->buf, K_NO_WAIT) != 0) {
+        return NULL;
+    }
+
+    memset(entry->received, 0, sizeof(entry->received));
+    entry->src    = src;
+    entry->msg_id = hdr[0];
+    entry->count  = hdr[2];
+    entry->size   = hdr[3];
+    entry->have   = 0;
+    entry->len    = 0;
+    return entry;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  A fragment from "src", in any order.  Called on the radio thread.        */
+/*---------------------------------------------------------------------------*/
+void lora_frag_input(u8_t src, const u8_t * fragment, u8_t len, u32_t now)
+{
+    struct frag_entry * entry;
+    u8_t  index = fragment[1];
+    u8_t  count = fragment[2];
+    u8_t  size  = fragment[3];
+    u8_t  chunk = len - LORA_FRAG_HDR_LEN;
+
+    stats.rx_fragments++;
+
+    if (len <= LORA_FRAG_HDR_LEN || index >= count || size == 0 ||
+        (count - 1) * size >= LORA_FRAG_MAX_LEN ||
+        (index < count - 1 && chunk != size) || chunk > size) {
+        stats.rx_dropped++;
+        return;
+    }
+
+    entry = frag_entry(src, fragment, now);
+    if (!entry || entry->count != count || entry->size != size ||
+        index * size + chunk > LORA_FRAG_MAX_LEN) {
+        LOG_WRN("Fragment %u/%u from %u dropped", index, count, src);
+        stats.rx_dropped++;
+        return;
+    }
+
+    entry->last_seen = now;
+
+    if (entry->received[index / 32] & BIT(index % 32)) {
+        return;
+    }
+
+    memcpy(&entry->buf[index * size], &fragment[LORA_FRAG_HDR_LEN], chunk);
+    entry->received[index / 32] |= BIT(index % 32);
+    entry->have++;
+
+    if (index == count - 1) {
+        entry->len = index * size + chunk;
+    }
+
+    if (entry->have < count) {
+        return;
+    }
+
+    stats.rx_messages++;
+    LOG_DBG("%u byte message from %u", entry->len, src);
+
+    if (rx_callback) {
+        rx_callback(src, entry->buf, entry->len);
+    }
+
+    frag_release(entry);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Evict messages that stopped receiving fragments.                         */
+/*---------------------------------------------------------------------------*/
+void lora_frag_tick(u32_t now)
+{
+    int i;
+
+    for (i = 0; i < LORA_FRAG_POOL; i++) {
+        if (entries[i].buf &&
+            now - entries[i].last_seen > LORA_FRAG_TIMEOUT_MS) {
+            LOG_WRN("Message %u from %u timed out (%u/%u fragments)",
+                    entries[i].msg_id, entries[i].src, entries[i].have,
+                    entries[i].count);
+            stats.rx_evicted++;
+            frag_release(&entries[i]);
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_frag_get_stats(struct lora_frag_stats * out)
+{
+    *out = stats;
+}
@@ -0,0 +1,361 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "lora_hop.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_hop);
+
+#define RENDEZVOUS  0   // plan entry that is never skipped
+
+static const u32_t default_plan[] = LORA_HOP_PLAN_US915_SB2;
+
+static struct lora_hop_channel channels[LORA_HOP_CHANNELS_MAX];
+static u8_t  channel_count;
+
+static u8_t  order[LORA_HOP_CHANNELS_MAX];     // slot position -> channel
+static u8_t  position[LORA_HOP_CHANNELS_MAX];  // channel -> slot position
+
+static bool  enabled = LORA_HOP_ENABLED;
+static bool  master;
+static bool  synced;
+static u32_t epoch;         // uptime at the start of slot 0
+static u32_t last_sync;
+static u32_t last_target;   // slot chosen by the last lora_hop_tx_wait_ms
+
+static struct lora_hop_stats stats;
+
+/*---------------------------------------------------------------------------*/
+/*  Fisher-Yates shuffle driven by xorshift32: the same on every node.       */
+/*---------------------------------------------------------------------------*/
+static void hop_shuffle(void)
+{
+    u32_t x = LORA_HOP_SEED;
+    u8_t  tmp;
+    int   i;
+    int   j;
+
+    for (i = 0; i < channel_count; i++) {
+        order[i] = i;
+    }
+
+    for (i = channel_count - 1; i > 0; i--) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+
+        j = x % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    for (i = 0; i < channel_count; i++) {
+        position[order[i]] = i;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static u32_t hop_slot(u32_t now, u32_t * offset)
+{
+    u32_t elapsed = now - epoch;
+
+    *offset = elapsed % LORA_HOP_DWELL_MS;
+    return elapsed / LORA_HOP_DWELL_MS;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Followers lose the sequence when the master has been silent too long.    */
+/*---------------------------------------------------------------------------*/
+static bool hop_synced(u32_t now)
+{
+    if (synced && !master && now - last_sync > LORA_HOP_SYNC_TIMEOUT_MS) {
+        LOG_INF("Hop: lost sync, back to rendezvous");
+        synced = false;
+        stats.sync_lost++;
+    }
+    return synced;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Whether to send on "channel": unknown channels and the rendezvous        */
+/*  always qualify, poor ones only when a probe is due.                      */
+/*---------------------------------------------------------------------------*/
+static bool hop_usable(u8_t channel, u32_t now)
+{
+    const struct lora_hop_channel * ch = &channels[channel];
+    s16_t quietest = INT16_MAX;
+    int   i;
+
+    if (channel == RENDEZVOUS || ch->rx_frames + ch->rx_bad == 0) {
+        return true;
+    }
+
+    if (now - ch->last_tx >= LORA_HOP_PROBE_MS) {
+        return true;
+    }
+
+    if (ch->success < LORA_HOP_MIN_SUCCESS_PERMILLE) {
+        return false;
+    }
+
+    for (i = 0; i < channel_count; i++) {
+        if (channels[i].rx_frames) {
+            quietest = MIN(quietest, channels[i].noise);
+        }
+    }
+
+    return !ch->rx_frames || ch->noise <= quietest + LORA_HOP_NOISE_MARGIN_DB;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  The master runs the slot clock; followers start unsynchronized.          */
+/*---------------------------------------------------------------------------*/
+void lora_hop_init(bool is_master, u32_t now)
+{
+    master = is_master;
+    synced = is_master;
+    epoch  = now;
+    last_target = UINT32_MAX;
+
+    lora_hop_set_plan(default_plan, ARRAY_SIZE(default_plan));
+
+    LOG_INF("Hop: %u channels, %s, %s", channel_count,
+            master ? "master" : "follower", enabled ? "on" : "off");
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Replace the channel plan; the quality table starts over.  Every node     */
+/*  must use the same plan.                                                  */
+/*---------------------------------------------------------------------------*/
+int lora_hop_set_plan(const u32_t * frequencies, u8_t count)
+{
+    int i;
+
+    if (count == 0 || count > LORA_HOP_CHANNELS_MAX) {
+        return -EINVAL;
+    }
+
+    memset(channels, 0, sizeof(channels));
+
+    for (i = 0; i < count; i++) {
+        channels[i].frequency = frequencies[i];
+        channels[i].success   = 1000;
+    }
+    channel_count = count;
+
+    hop_shuffle();
+
+    synced = master;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_hop_set_enabled(bool enable)
+{
+    enabled = enable;
+}
+
+bool lora_hop_enabled(void)
+{
+    return enabled;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Channel to use at "now".                                                 */
+/*---------------------------------------------------------------------------*/
+u8_t lora_hop_channel(u32_t now)
+{
+    u32_t offset;
+
+    if (!enabled || !hop_synced(now)) {
+        return RENDEZVOUS;
+    }
+
+    return order[hop_slot(now, &offset) % channel_count];
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+u32_t lora_hop_frequency(u8_t channel)
+{
+    return channels[channel].frequency;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Time left on the current channel; UINT32_MAX while not hopping.          */
+/*---------------------------------------------------------------------------*/
+u32_t lora_hop_slot_remaining_ms(u32_t now)
+{
+    u32_t offset;
+
+    if (!enabled || !hop_synced(now)) {
+        return UINT32_MAX;
+    }
+
+    hop_slot(now, &offset);
+    return LORA_HOP_DWELL_MS - offset;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  How far into the current slot "now" is; UINT32_MAX while not hopping.    */
+/*---------------------------------------------------------------------------*/
+u32_t lora_hop_slot_offset_ms(u32_t now)
+{
+    u32_t offset;
+
+    if (!enabled || !hop_synced(now)) {
+        return UINT32_MAX;
+    }
+
+    hop_slot(now, &offset);
+    return offset;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Milliseconds until the next slot start, on a usable channel, where a     */
+/*  frame may go out: 0 means send now on lora_hop_channel().                */
+/*---------------------------------------------------------------------------*/
+u32_t lora_hop_tx_wait_ms(u32_t now)
+{
+    u32_t offset;
+    u32_t slot;
+    u32_t skipped = 0;
+    u32_t k;
+
+    if (!enabled || !hop_synced(now)) {
+        return 0;
+    }
+
+    slot = hop_slot(now, &offset);
+
+    /* The rendezvous comes round within one cycle, so this always ends */
+    for (k = 0; k <= channel_count; k++) {
+
+        if (k == 0 && offset >= LORA_HOP_GUARD_MS + LORA_HOP_TX_SLACK_MS) {
+            continue;
+        }
+
+        if (!hop_usable(order[(slot + k) % channel_count], now)) {
+            skipped++;
+            continue;
+        }
+
+        if (slot + k != last_target) {
+            stats.slots_skipped += skipped;
+            last_target = slot + k;
+        }
+
+        if (k == 0) {
+            return (offset < LORA_HOP_GUARD_MS) ? LORA_HOP_GUARD_MS - offset : 0;
+        }
+        return k * LORA_HOP_DWELL_MS - offset + LORA_HOP_GUARD_MS;
+    }
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_hop_tx_done(u8_t channel, u32_t airtime_us, u32_t now)
+{
+    if (!enabled) {
+        return;
+    }
+
+    channels[channel].tx_frames++;
+    channels[channel].last_tx = now;
+
+    if (airtime_us / USEC_PER_MSEC + LORA_HOP_GUARD_MS > LORA_HOP_DWELL_MS) {
+        stats.overruns++;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Feed the outcome of a reception on "channel"; "ok" means it decoded.     */
+/*---------------------------------------------------------------------------*/
+void lora_hop_rx_update(u8_t channel, bool ok, s16_t rssi, s8_t snr)
+{
+    struct lora_hop_channel * ch = &channels[channel];
+
+    if (!enabled) {
+        return;
+    }
+
+    if (!ok) {
+        ch->rx_bad++;
+        ch->success -= ch->success / 8;
+        return;
+    }
+
+    if (ch->rx_frames == 0) {
+        ch->rssi  = rssi;
+        ch->noise = rssi - snr;
+    }
+    else {
+        /* Exponential averages, weight 1/8 as in lora_adr.c */
+        ch->rssi  += (rssi - ch->rssi) / 8;
+        ch->noise += ((rssi - snr) - ch->noise) / 8;
+    }
+
+    ch->success += (1000 - ch->success) / 8;
+    ch->rx_frames++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  A frame from the master that ended at "now" started "offset_ms" into     */
+/*  the slot that maps to "channel": realign the slot clock on it.           */
+/*  UINT32_MAX means the master sent it while not hopping.                   */
+/*---------------------------------------------------------------------------*/
+void lora_hop_sync(u8_t src, u8_t channel, u32_t offset_ms,
+                   u32_t airtime_us, u32_t now)
+{
+    u32_t slot_start;
+
+    if (!enabled || master || src != LORA_HOP_MASTER_ID ||
+        offset_ms >= LORA_HOP_DWELL_MS) {
+        return;
+    }
+
+    slot_start = now - airtime_us / USEC_PER_MSEC - offset_ms;
+    epoch = slot_start - position[channel] * LORA_HOP_DWELL_MS;
+
+    if (!synced) {
+        LOG_INF("Hop: synchronized on channel %u", channel);
+    }
+
+    synced = true;
+    last_sync = now;
+    stats.syncs++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+const struct lora_hop_channel * lora_hop_channel_get(u8_t channel)
+{
+    return (channel < channel_count) ? &channels[channel] : NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_hop_get_stats(struct lora_hop_stats * out)
+{
+    *out = stats;
+}
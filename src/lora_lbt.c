@@ -0,0 +1,87 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <random/rand32.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "lora_lbt.h"
+
+#ifdef CONFIG_BOARD_NATIVE_POSIX
+#include "lora_sim.h"
+#else
+/* The Zephyr lora API has no carrier sense: use the LoRaMac-node radio */
+#include <sx1276/sx1276.h>
+#endif
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_lbt);
+
+static struct lora_lbt_stats stats;
+
+/*---------------------------------------------------------------------------*/
+/*  Sample the RSSI on "frequency".  Must run on the radio thread, between   */
+/*  operations: the radio is left asleep.                                    */
+/*---------------------------------------------------------------------------*/
+bool lora_lbt_channel_clear(u32_t frequency)
+{
+    bool clear;
+
+#ifdef CONFIG_BOARD_NATIVE_POSIX
+    clear = lora_sim_channel_free(frequency, LORA_LBT_RSSI_THRESHOLD,
+                                  LORA_LBT_SENSE_MS);
+#else
+    clear = SX1276IsChannelFree(MODEM_LORA, frequency, LORA_LBT_RSSI_THRESHOLD,
+                                LORA_LBT_SENSE_MS);
+#endif
+
+    if (clear) {
+        stats.clear++;
+    }
+    else {
+        stats.busy++;
+    }
+    return clear;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Random backoff after the "attempt"th busy channel (from 1): between one  */
+/*  and CW slots, CW doubling per attempt.                                   */
+/*---------------------------------------------------------------------------*/
+u32_t lora_lbt_backoff_ms(u8_t attempt, u32_t airtime_us)
+{
+    u32_t slot_ms = MAX(airtime_us / USEC_PER_MSEC, LORA_LBT_SLOT_MIN_MS);
+    u32_t cw = LORA_LBT_CW_MIN;
+    u32_t backoff;
+
+    while (--attempt && cw < LORA_LBT_CW_MAX) {
+        cw *= 2;
+    }
+
+    backoff = (1 + sys_rand32_get() % cw) * slot_ms;
+
+    stats.backoffs++;
+    stats.backoff_ms += backoff;
+
+    return backoff;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_lbt_dropped(void)
+{
+    stats.dropped++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_lbt_get_stats(struct lora_lbt_stats * out)
+{
+    *out = stats;
+}
@@ -0,0 +1,87 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "lora_power.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_power);
+
+static const u32_t state_ua[LORA_POWER__STATES] = {
+    [LORA_POWER__SLEEP]   = LORA_POWER_SLEEP_UA,
+    [LORA_POWER__STANDBY] = LORA_POWER_STANDBY_UA,
+    [LORA_POWER__RX]      = LORA_POWER_RX_UA,
+    [LORA_POWER__TX]      = LORA_POWER_TX_UA,
+};
+
+static lora_power_state_t state = LORA_POWER__SLEEP;
+static u32_t state_since;       // k_cycle_get_32() at the last change
+
+static u64_t time_us[LORA_POWER__STATES];
+
+/*---------------------------------------------------------------------------*/
+/*  Called by the radio thread around every radio operation.                 */
+/*---------------------------------------------------------------------------*/
+void lora_power_enter(lora_power_state_t next)
+{
+    unsigned int key;
+    u32_t now;
+
+    key = irq_lock();
+
+    now = k_cycle_get_32();
+    time_us[state] += k_cyc_to_us_floor32(now - state_since);
+    state_since = now;
+    state = next;
+
+    irq_unlock(key);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Time per state up to now, and the charge it adds up to.                  */
+/*---------------------------------------------------------------------------*/
+void lora_power_get_stats(struct lora_power_stats * out)
+{
+    unsigned int key;
+    u64_t total_us = 0;
+    u64_t charge = 0;   // uA * us
+    int   i;
+
+    key = irq_lock();
+
+    memcpy(out->time_us, time_us, sizeof(time_us));
+    out->time_us[state] += k_cyc_to_us_floor32(k_cycle_get_32() - state_since);
+
+    irq_unlock(key);
+
+    for (i = 0; i < LORA_POWER__STATES; i++) {
+        charge   += out->time_us[i] * state_ua[i];
+        total_us += out->time_us[i];
+    }
+    charge += total_us * LORA_POWER_MCU_IDLE_UA;
+
+    out->charge_uah = (u32_t)(charge / ((u64_t)3600 * USEC_PER_SEC));
+    out->average_ua = total_us ? (u32_t)(charge / total_us) : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Remaining battery, percent, from the estimated charge drawn.             */
+/*---------------------------------------------------------------------------*/
+u8_t lora_power_battery_level(void)
+{
+    struct lora_power_stats stats;
+    u32_t used;
+
+    lora_power_get_stats(&stats);
+
+    used = stats.charge_uah / (LORA_POWER_BATTERY_MAH * 10);  // percent
+
+    return (used >= 100) ? 0 : 100 - used;
+}
@@ -0,0 +1,379 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <init.h>
+#include <string.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#ifdef CONFIG_CPU_CORTEX_M_HAS_DWT
+#include <soc.h>
+#endif
+
+#ifndef CONFIG_BOARD_NATIVE_POSIX
+#include <drivers/gpio.h>
+#endif
+
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "lora_prof.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(lora_prof);
+
+/* DIO0 of the SX1276 node: TxDone in TX, RxDone in RX */
+#if !defined(CONFIG_BOARD_NATIVE_POSIX) && \
+    defined(DT_INST_0_SEMTECH_SX1276_DIO_GPIOS_CONTROLLER_0)
+#define PROF_DIO0_PORT  DT_INST_0_SEMTECH_SX1276_DIO_GPIOS_CONTROLLER_0
+#define PROF_DIO0_PIN   DT_INST_0_SEMTECH_SX1276_DIO_GPIOS_PIN_0
+#endif
+
+struct prof_phase {
+    u32_t count;
+    u32_t min;
+    u32_t max;
+    u64_t sum;
+    u64_t cpu_sum;
+    u32_t cpu_max;
+    u16_t bucket[LORA_PROF_BUCKETS];
+};
+
+static const char * const phase_names[LORA_PROF__COUNT] = {
+    [LORA_PROF__CONFIG]   = "config",
+    [LORA_PROF__TX_LOAD]  = "tx_load",
+    [LORA_PROF__TX_DONE]  = "tx_done",
+    [LORA_PROF__TX_TOTAL] = "tx_total",
+    [LORA_PROF__RX_DONE]  = "rx_done",
+};
+
+static struct prof_phase phases[LORA_PROF__COUNT];
+
+#ifdef PROF_DIO0_PORT
+static struct gpio_callback dio0_cb;
+static volatile bool dio0_fired;
+static struct lora_prof_stamp dio0_at;
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_prof_stamp(struct lora_prof_stamp * stamp)
+{
+    stamp->cycles = k_cycle_get_32();
+#ifdef CONFIG_CPU_CORTEX_M_HAS_DWT
+    stamp->cpu = DWT->CYCCNT;
+#else
+    stamp->cpu = 0;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Bucket: below 8 the value itself, then four per octave, indexed by the  */
+/*  most significant bit and the two bits below it.                          */
+/*---------------------------------------------------------------------------*/
+static u8_t prof_bucket(u32_t cycles)
+{
+    u32_t msb;
+
+    if (cycles < 8) {
+        return cycles;
+    }
+
+    msb = 31 - __builtin_clz(cycles);
+    return msb * 4 + ((cycles >> (msb - 2)) & 3);
+}
+
+static u64_t prof_bucket_bound(u8_t bucket)
+{
+    if (bucket < 8) {
+        return bucket + 1;
+    }
+    return (u64_t)(5 + bucket % 4) << (bucket / 4 - 2);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  "cycles" of elapsed time and "cpu" DWT cycles spent in "phase".          */
+/*---------------------------------------------------------------------------*/
+static void prof_record(lora_prof_phase_t phase, u32_t cycles, u32_t cpu)
+{
+    struct prof_phase * p = &phases[phase];
+    u8_t bucket = prof_bucket(cycles);
+    int  i;
+
+    if (p->count == 0 || cycles < p->min) {
+        p->min = cycles;
+    }
+    if (cycles > p->max) {
+        p->max = cycles;
+    }
+    if (cpu > p->cpu_max) {
+        p->cpu_max = cpu;
+    }
+    p->sum     += cycles;
+    p->cpu_sum += cpu;
+    p->count++;
+
+    /* Halve the histogram rather than saturate: the shape is kept */
+    if (p->bucket[bucket] == UINT16_MAX) {
+        for (i = 0; i < LORA_PROF_BUCKETS; i++) {
+            p->bucket[i] /= 2;
+        }
+    }
+    p->bucket[bucket]++;
+}
+
+#ifdef PROF_DIO0_PORT
+/*---------------------------------------------------------------------------*/
+/*  Runs in the GPIO ISR, next to the driver's own DIO0 callback.            */
+/*---------------------------------------------------------------------------*/
+static void prof_dio0_isr(struct device * port, struct gpio_callback * cb,
+                          gpio_port_pins_t pins)
+{
+    if (!dio0_fired) {
+        lora_prof_stamp(&dio0_at);
+        dio0_fired = true;
+    }
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*  When DIO0 first fired since lora_prof_arm().                             */
+/*---------------------------------------------------------------------------*/
+static bool prof_dio0(struct lora_prof_stamp * at)
+{
+#ifdef PROF_DIO0_PORT
+    *at = dio0_at;
+    return dio0_fired;
+#else
+    return false;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Microseconds since "start": CPU time from DWT where there is one, else   */
+/*  elapsed time from the kernel cycle counter.                              */
+/*---------------------------------------------------------------------------*/
+u32_t lora_prof_elapsed_us(const struct lora_prof_stamp * start)
+{
+    struct lora_prof_stamp end;
+
+    lora_prof_stamp(&end);
+
+#ifdef CONFIG_CPU_CORTEX_M_HAS_DWT
+    return (u32_t)(((u64_t)(end.cpu - start->cpu) * USEC_PER_SEC) /
+                   SystemCoreClock);
+#else
+    return k_cyc_to_us_floor32(end.cycles - start->cycles);
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Start the CPU cycle counter before any APPLICATION init that times       */
+/*  itself with it.                                                          */
+/*---------------------------------------------------------------------------*/
+static int lora_prof_cpu_init(struct device * dev)
+{
+    ARG_UNUSED(dev);
+
+#ifdef CONFIG_CPU_CORTEX_M_HAS_DWT
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
+    return 0;
+}
+
+SYS_INIT(lora_prof_cpu_init, PRE_KERNEL_1, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+
+/*---------------------------------------------------------------------------*/
+/*  Hook DIO0; before the radio is used.                                     */
+/*---------------------------------------------------------------------------*/
+void lora_prof_init(void)
+{
+#ifdef PROF_DIO0_PORT
+    {
+        struct device * gpio = device_get_binding(PROF_DIO0_PORT);
+
+        if (gpio) {
+            gpio_init_callback(&dio0_cb, prof_dio0_isr, BIT(PROF_DIO0_PIN));
+            gpio_add_callback(gpio, &dio0_cb);
+        }
+        else {
+            LOG_WRN("Profiling: no DIO0, phases after IRQ not recorded");
+        }
+    }
+#endif
+
+    lora_prof_reset();
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Call just before lora_send() or lora_recv().                             */
+/*---------------------------------------------------------------------------*/
+void lora_prof_arm(void)
+{
+#ifdef PROF_DIO0_PORT
+    dio0_fired = false;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Call just after lora_config() returns.                                   */
+/*---------------------------------------------------------------------------*/
+void lora_prof_config(const struct lora_prof_stamp * start)
+{
+    struct lora_prof_stamp end;
+
+    lora_prof_stamp(&end);
+    prof_record(LORA_PROF__CONFIG, end.cycles - start->cycles,
+                end.cpu - start->cpu);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Call just after lora_send() returns successfully.                        */
+/*---------------------------------------------------------------------------*/
+void lora_prof_send(const struct lora_prof_stamp * start, u32_t airtime_us)
+{
+    struct lora_prof_stamp end;
+    struct lora_prof_stamp done;
+    u32_t airtime = k_us_to_cyc_floor32(airtime_us);
+    u32_t load;
+
+    lora_prof_stamp(&end);
+    prof_record(LORA_PROF__TX_TOTAL, end.cycles - start->cycles,
+                end.cpu - start->cpu);
+
+    if (prof_dio0(&done)) {
+        load = done.cycles - start->cycles;
+        prof_record(LORA_PROF__TX_LOAD, (load > airtime) ? load - airtime : 0,
+                    done.cpu - start->cpu);
+        prof_record(LORA_PROF__TX_DONE, end.cycles - done.cycles,
+                    end.cpu - done.cpu);
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Call just after lora_recv() returns a frame.                             */
+/*---------------------------------------------------------------------------*/
+void lora_prof_recv(void)
+{
+    struct lora_prof_stamp end;
+    struct lora_prof_stamp done;
+
+    lora_prof_stamp(&end);
+
+    if (prof_dio0(&done)) {
+        prof_record(LORA_PROF__RX_DONE, end.cycles - done.cycles,
+                    end.cpu - done.cpu);
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Summary in microseconds; p99 is the upper bound of its bucket.           */
+/*---------------------------------------------------------------------------*/
+void lora_prof_get(lora_prof_phase_t phase, struct lora_prof_summary * out)
+{
+    const struct prof_phase * p = &phases[phase];
+    u32_t total = 0;
+    u32_t seen = 0;
+    u32_t rank;
+    int   i;
+
+    memset(out, 0, sizeof(*out));
+
+    if (p->count == 0) {
+        return;
+    }
+
+    out->count   = p->count;
+    out->min_us  = k_cyc_to_us_floor32(p->min);
+    out->max_us  = k_cyc_to_us_floor32(p->max);
+    out->avg_us  = k_cyc_to_us_floor32(p->sum / p->count);
+    out->cpu_avg = p->cpu_sum / p->count;
+    out->cpu_max = p->cpu_max;
+
+    for (i = 0; i < LORA_PROF_BUCKETS; i++) {
+        total += p->bucket[i];
+    }
+
+    rank = total - total / 100;
+
+    for (i = 0; i < LORA_PROF_BUCKETS; i++) {
+        seen += p->bucket[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    out->p99_us = k_cyc_to_us_floor32(MIN(prof_bucket_bound(i), p->max));
+}
+
+const char * lora_prof_name(lora_prof_phase_t phase)
+{
+    return phase_names[phase];
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void lora_prof_dump(void)
+{
+    struct lora_prof_summary s;
+    int i;
+
+    for (i = 0; i < LORA_PROF__COUNT; i++) {
+        lora_prof_get(i, &s);
+        LOG_INF("%-8s n=%u min %uus avg %uus max %uus p99 %uus, "
+                "cpu avg %u max %u", lora_prof_name(i), s.count, s.min_us,
+                s.avg_us, s.max_us, s.p99_us, s.cpu_avg, s.cpu_max);
+    }
+}
+
+void lora_prof_reset(void)
+{
+    memset(phases, 0, sizeof(phases));
+}
+
+#ifdef CONFIG_SHELL
+/*---------------------------------------------------------------------------*/
+/*  "prof": per-phase timings; "prof reset" starts over.                     */
+/*---------------------------------------------------------------------------*/
+static int cmd_prof_show(const struct shell * shell, size_t argc, char ** argv)
+{
+    struct lora_prof_summary s;
+    int i;
+
+    shell_print(shell, "%-8s %7s %7s %7s %7s %7s %9s %9s", "phase", "count",
+                "min_us", "avg_us", "max_us", "p99_us", "cpu_avg", "cpu_max");
+
+    for (i = 0; i < LORA_PROF__COUNT; i++) {
+        lora_prof_get(i, &s);
+        shell_print(shell, "%-8s %7u %7u %7u %7u %7u %9u %9u",
+                    lora_prof_name(i), s.count, s.min_us, s.avg_us, s.max_us,
+                    s.p99_us, s.cpu_avg, s.cpu_max);
+    }
+    return 0;
+}
+
+static int cmd_prof_reset(const struct shell * shell, size_t argc,
+                          char ** argv)
+{
+    lora_prof_reset();
+    shell_print(shell, "profile cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(prof_cmds,
+    SHELL_CMD(reset, NULL, "Clear the radio phase timings", cmd_prof_reset),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(prof, &prof_cmds, "Radio phase timings", cmd_prof_show);
+#endif  // CONFIG_SHELL
@@ -3,6 +3,7 @@
  */
 #include <zephyr.h>
 #include <sys/printk.h>
+#include <sys/util.h>
 
 #include <logging/log.h>
 LOG_MODULE_REGISTER(main, 3);
@@ -10,79 +11,259 @@ LOG_MODULE_REGISTER(main, 3);
 #define STACKSIZE 1024
 #define PRIORITY 7
 
-int LoRa_init( void );
+/*
+ *  Threads: the radio scheduler keeps its own thread, since lora_recv()
+ *  blocks for the whole RX window; everything else runs from the event
+ *  loop in main() or from the system work queue.
+ */
+#define REPORT_PERIOD_MS    60000
+
+#if defined(CONFIG_LORA) || defined(CONFIG_BOARD_NATIVE_POSIX)
+#include "lora_app.h"
+#include "lora_bridge.h"
+#include "lora_codec.h"
+#include "lora_frag.h"
+#include "lora_hop.h"
+#include "lora_lbt.h"
+#include "lora_power.h"
+#include "node_config.h"
+#include "trace.h"
+
+/* On native_posix the benchmark harness (sim/lora_bench.c) is the consumer */
+#ifndef CONFIG_BOARD_NATIVE_POSIX
 
-//#ifdef CONFIG_BT
-#if 0
 /*---------------------------------------------------------------------------*/
-/*                                                                           */
+/*  RX callback: runs on the radio thread, so it must not block.  Each frame */
+/*  is already in the packet trace (trace.h); the dump is for debug builds.  */
 /*---------------------------------------------------------------------------*/
-#include "ble_policy.h"
-#include "ble_base.h"
-
-void bluetooth_thread(void * id, void * unused1, void * unused2)
+static void lora_rx_deliver(lora_rx_frame_t * frame)
 {
-    LOG_INF("%s", __func__);
-
-    ble_policy_init();
+    LOG_HEXDUMP_DBG(LORA_FRAME_PAYLOAD(frame->data), frame->hdr.len,
+                    "Received data");
 
-    while(1) { /* spin */}
+    /* The bridge releases the frame */
+    lora_bridge_forward(frame);
 }
 
-K_THREAD_DEFINE(bluetooth_id, STACKSIZE, bluetooth_thread, 
-                NULL, NULL, NULL, PRIORITY, 0, K_NO_WAIT);
-#endif
-
-#ifdef CONFIG_LORA
-#include "lora_app.h"
+/*---------------------------------------------------------------------------*/
+/*  Reassembled message: also on the radio thread.                           */
+/*---------------------------------------------------------------------------*/
+static void lora_rx_message(u8_t src, const u8_t * msg, u16_t len)
+{
+    LOG_HEXDUMP_INF(msg, MIN(len, 32), "Received message");
+    LOG_INF("%u bytes from %u", len, src);
+}
+#endif // CONFIG_BOARD_NATIVE_POSIX
 
-#ifdef LORA_APP_TX_MODE
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-void lora_send_thread(void * id, void * unused1, void * unused2)
+void lora_radio_thread(void * id, void * unused1, void * unused2)
 {
     LOG_INF("%s", __func__);
 
+#ifndef CONFIG_BOARD_NATIVE_POSIX
+    lora_app_set_rx_callback(lora_rx_deliver);
+    lora_frag_set_rx_callback(lora_rx_message);
+#endif
+
     if (lora_app_init() == 0) {
-        lora_app_send();  // never returns
+        lora_app_run();  // never returns
     }
 }
 
-K_THREAD_DEFINE(lora_send_id, STACKSIZE, lora_send_thread, 
+K_THREAD_DEFINE(lora_radio_id, STACKSIZE, lora_radio_thread, 
                 NULL, NULL, NULL, PRIORITY, 0, K_NO_WAIT);
+
+#endif // CONFIG_LORA
+
+#ifdef CONFIG_BT
+#include "ble_policy.h"
+#include "ble_base.h"
 #endif
 
-#ifndef LORA_APP_TX_MODE
+/* The BLE bridge of received LoRa frames needs both ends */
+#if defined(CONFIG_BT) && \
+    (defined(CONFIG_LORA) || defined(CONFIG_BOARD_NATIVE_POSIX))
+#define MAIN_LORA_BRIDGE
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*  Event loop                                                               */
+/*---------------------------------------------------------------------------*/
+enum {
+    EVENT_REPORT = 0,
+#ifdef CONFIG_BT
+    EVENT_BLE_QUEUE,
+#endif
+#ifdef MAIN_LORA_BRIDGE
+    EVENT_BRIDGE,       // LORA_BRIDGE_POLL_EVENTS entries
+    EVENT_BRIDGE_LAST = EVENT_BRIDGE + LORA_BRIDGE_POLL_EVENTS - 1,
+#endif
+    EVENT_COUNT
+};
+
+static struct k_poll_event events[EVENT_COUNT];
+
+static struct k_poll_signal report_signal;
+static struct k_timer report_timer;
+
+static u32_t loop_busy_us;
+static u32_t loop_wakeups;
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-void lora_receive_thread(void * id, void * unused1, void * unused2)
+static void report_expiry(struct k_timer * timer)
 {
-    LOG_INF("%s", __func__);
-
-    if (lora_app_init() == 0) {
-        lora_app_receive();  // never returns
-    }
+    k_poll_signal_raise(&report_signal, 0);
 }
 
-K_THREAD_DEFINE(lora_receive_id, STACKSIZE, lora_receive_thread, 
-                NULL, NULL, NULL, PRIORITY, 0, K_NO_WAIT);
+/*---------------------------------------------------------------------------*/
+/*  Periodic summary; the busy figure is this loop's share of the period.    */
+/*---------------------------------------------------------------------------*/
+static void report(void)
+{
+    LOG_INF("loop: %u wakeups, busy %u.%u%%", loop_wakeups,
+            loop_busy_us / (REPORT_PERIOD_MS * 10),
+            (loop_busy_us / REPORT_PERIOD_MS) % 10);
+
+#if defined(CONFIG_LORA) || defined(CONFIG_BOARD_NATIVE_POSIX)
+    {
+        struct lora_app_stats app;
+        struct lora_codec_stats codec;
+        struct lora_frag_stats frag;
+        struct lora_lbt_stats lbt;
+        struct lora_power_stats power;
+        struct node_config_stats config;
+        struct trace_stats trace;
+
+        lora_app_get_stats(&app);
+        LOG_INF("lora: tx %u rx %u errors %u", app.tx_frames, app.rx_frames,
+                app.radio_errors);
+
+        node_config_get_stats(&config);
+        LOG_INF("boot: %s config read in %uus, first frame on air at %ums",
+                config.stored ? "stored" : "default", config.load_us,
+                app.first_tx_ms);
+
+        LOG_INF("arq: acked %u failed %u resent %u timeouts %u, "
+                "goodput %ubps of %ubps", app.arq_acked, app.arq_failed,
+                app.arq_retransmissions, app.arq_timeouts, app.goodput_bps,
+                app.throughput_bps);
+
+        lora_codec_get_stats(&codec);
+        LOG_INF("codec: %u of %u frames coded, %u bytes saved, "
+                "encode %ucyc decode %ucyc", codec.compressed, codec.frames,
+                codec.bytes_in - codec.bytes_out, codec.encode_cycles,
+                codec.decode_cycles);
+
+        lora_frag_get_stats(&frag);
+        LOG_INF("frag: tx %u msgs (%u frags), rx %u msgs (%u frags), "
+                "evicted %u dropped %u", frag.tx_messages, frag.tx_fragments,
+                frag.rx_messages, frag.rx_fragments, frag.rx_evicted,
+                frag.rx_dropped);
+
+        lora_lbt_get_stats(&lbt);
+        LOG_INF("lbt: clear %u busy %u, backoff %ums, dropped %u, "
+                "rx crc errors %u", lbt.clear, lbt.busy, lbt.backoff_ms,
+                lbt.dropped, app.rx_bad_frames);
+
+        lora_power_get_stats(&power);
+        LOG_INF("power: tx %ums rx %ums sleep %ums, avg %uuA, %uuAh",
+                (u32_t)(power.time_us[LORA_POWER__TX] / USEC_PER_MSEC),
+                (u32_t)(power.time_us[LORA_POWER__RX] / USEC_PER_MSEC),
+                (u32_t)(power.time_us[LORA_POWER__SLEEP] / USEC_PER_MSEC),
+                power.average_ua, power.charge_uah);
+        LOG_INF("sleeps %u (%u early), wake latency %uus max %uus",
+                app.sleeps, app.sleep_wakes_early,
+                app.wake_latency_last_us, app.wake_latency_max_us);
+
+        trace_get_stats(&trace);
+        LOG_INF("trace: level %u, %u records, %u dropped", trace_level,
+                trace.written, trace.dropped);
+
+        if (lora_hop_enabled()) {
+            struct lora_hop_stats hop;
+            const struct lora_hop_channel * ch;
+            u8_t i;
+
+            lora_hop_get_stats(&hop);
+            LOG_INF("hop: %u retunes, %u syncs (%u lost), %u slots skipped",
+                    app.retunes, hop.syncs, hop.sync_lost, hop.slots_skipped);
+
+            for (i = 0; (ch = lora_hop_channel_get(i)) != NULL; i++) {
+                LOG_DBG("%uHz: tx %u rx %u bad %u, %u%% rssi %d noise %d",
+                        ch->frequency, ch->tx_frames, ch->rx_frames,
+                        ch->rx_bad, ch->success / 10, ch->rssi, ch->noise);
+            }
+        }
+    }
 #endif
 
-#endif // CONFIG_LORA
+    loop_busy_us = 0;
+    loop_wakeups = 0;
+}
 
 /*---------------------------------------------------------------------------*/
-/*                                                                           */
+/*  Radio, BLE and timer events are all dispatched from here.  Handlers     */
+/*  must not block; the loop sleeps in k_poll whenever nothing is pending.   */
 /*---------------------------------------------------------------------------*/
-void main_thread(void * id, void * unused1, void * unused2)
+void main(void)
 {
+    u32_t start;
+    int   i;
+
     LOG_INF("%s", __func__);
 
-    k_sleep( K_MSEC(500));
+    k_poll_signal_init(&report_signal);
+    k_timer_init(&report_timer, report_expiry, NULL);
+    k_poll_event_init(&events[EVENT_REPORT], K_POLL_TYPE_SIGNAL,
+                      K_POLL_MODE_NOTIFY_ONLY, &report_signal);
 
-   //ble_start_advertising();
-}
+#ifdef CONFIG_BT
+    if (ble_policy_init() < 0) {
+        LOG_ERR("BLE unavailable");
+    }
+    ble_queue_poll_init(&events[EVENT_BLE_QUEUE]);
+#endif
+#ifdef MAIN_LORA_BRIDGE
+    lora_bridge_poll_init(&events[EVENT_BRIDGE]);
+#endif
 
-K_THREAD_DEFINE(main_id, STACKSIZE, main_thread, 
-                NULL, NULL, NULL, PRIORITY, 0, K_NO_WAIT);
+    k_timer_start(&report_timer, REPORT_PERIOD_MS, REPORT_PERIOD_MS);
+
+    while (1) {
+
+        k_poll(events, EVENT_COUNT, K_FOREVER);
+
+        start = k_cycle_get_32();
+        loop_wakeups++;
+
+        if (events[EVENT_REPORT].state == K_POLL_STATE_SIGNALED) {
+            k_poll_signal_reset(&report_signal);
+            report();
+        }
+
+#ifdef CONFIG_BT
+        if (events[EVENT_BLE_QUEUE].state == K_POLL_STATE_SEM_AVAILABLE) {
+            ble_queue_drain();
+        }
+#endif
+
+#ifdef MAIN_LORA_BRIDGE
+        for (i = EVENT_BRIDGE; i <= EVENT_BRIDGE_LAST; i++) {
+            if (events[i].state != K_POLL_STATE_NOT_READY) {
+                lora_bridge_service();
+                break;
+            }
+        }
+#endif
+
+        for (i = 0; i < EVENT_COUNT; i++) {
+            events[i].state = K_POLL_STATE_NOT_READY;
+        }
+
+        loop_busy_us += k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    }
+}
@@ -0,0 +1,221 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/byteorder.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "metrics.h"
+
+struct hist_config {
+    const char * name;
+    s32_t lo;
+    u8_t  shift;
+    bool  log2;
+};
+
+static const char * const counter_names[METRIC_COUNT] = {
+    [METRIC_LORA_TX_FRAMES]     = "lora_tx_frames",
+    [METRIC_LORA_TX_ERRORS]     = "lora_tx_errors",
+    [METRIC_LORA_RX_FRAMES]     = "lora_rx_frames",
+    [METRIC_LORA_RX_CRC_ERRORS] = "lora_rx_crc_errors",
+    [METRIC_BLE_QUEUE_REFUSED]  = "ble_queue_refused",
+    [METRIC_BLE_NOTIFY_FAILED]  = "ble_notify_failed",
+};
+
+static const struct hist_config hist_config[METRIC_HIST_COUNT] = {
+    [METRIC_HIST_LORA_RSSI]       = { "lora_rssi_dbm",   -130, 3, false },
+    [METRIC_HIST_LORA_SNR]        = { "lora_snr_db",     -20,  2, false },
+    [METRIC_HIST_LORA_SEND_US]    = { "lora_send_us",    0,    14, true },
+    [METRIC_HIST_BLE_QUEUE_DEPTH] = { "ble_queue_depth", 0,    3, false },
+};
+
+atomic_t metrics_counters[METRIC_COUNT];
+
+static struct metrics_hist hists[METRIC_HIST_COUNT];
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static u8_t metrics_bucket(const struct hist_config * config, s32_t value)
+{
+    u32_t index;
+
+    if (value < config->lo) {
+        return 0;
+    }
+
+    if (config->log2) {
+        index = (u32_t)(value - config->lo) >> config->shift;
+        index = index ? 32 - __builtin_clz(index) : 0;
+    }
+    else {
+        index = (u32_t)(value - config->lo) >> config->shift;
+    }
+
+    return MIN(index, METRICS_BUCKETS - 1);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Record one sample; safe from any context.                                */
+/*---------------------------------------------------------------------------*/
+void metrics_observe(metric_hist_t id, s32_t value)
+{
+    struct metrics_hist * hist = &hists[id];
+
+    atomic_inc(&hist->count);
+    atomic_add(&hist->sum, value);
+    atomic_inc(&hist->bucket[metrics_bucket(&hist_config[id], value)]);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+u32_t metrics_get(metric_t id)
+{
+    return atomic_get(&metrics_counters[id]);
+}
+
+void metrics_hist_get(metric_hist_t id, struct metrics_hist * hist)
+{
+    int i;
+
+    atomic_set(&hist->count, atomic_get(&hists[id].count));
+    atomic_set(&hist->sum, atomic_get(&hists[id].sum));
+
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        atomic_set(&hist->bucket[i], atomic_get(&hists[id].bucket[i]));
+    }
+}
+
+const char * metrics_name(metric_t id)
+{
+    return counter_names[id];
+}
+
+const char * metrics_hist_name(metric_hist_t id)
+{
+    return hist_config[id].name;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Exclusive upper bound of "bucket"; the last bucket has none.             */
+/*---------------------------------------------------------------------------*/
+s32_t metrics_bucket_bound(metric_hist_t id, u8_t bucket)
+{
+    const struct hist_config * config = &hist_config[id];
+
+    if (config->log2) {
+        return config->lo + (1 << (config->shift + bucket));
+    }
+    return config->lo + ((bucket + 1) << config->shift);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Fill "buf" in the layout of metrics.h.  Returns the length written.      */
+/*---------------------------------------------------------------------------*/
+int metrics_export(u8_t * buf, size_t size)
+{
+    u8_t * p = buf;
+    int    i;
+    int    j;
+
+    if (size < METRICS_EXPORT_LEN) {
+        return -ENOMEM;
+    }
+
+    *p++ = METRICS_VERSION;
+    *p++ = METRIC_COUNT;
+    *p++ = METRIC_HIST_COUNT;
+    *p++ = METRICS_BUCKETS;
+
+    for (i = 0; i < METRIC_COUNT; i++, p += 4) {
+        sys_put_le32(atomic_get(&metrics_counters[i]), p);
+    }
+
+    for (i = 0; i < METRIC_HIST_COUNT; i++) {
+        sys_put_le32(atomic_get(&hists[i].count), p);
+        sys_put_le32(atomic_get(&hists[i].sum), p + 4);
+        p += 8;
+
+        for (j = 0; j < METRICS_BUCKETS; j++, p += 4) {
+            sys_put_le32(atomic_get(&hists[i].bucket[j]), p);
+        }
+    }
+
+    return p - buf;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void metrics_reset(void)
+{
+    int i;
+
+    for (i = 0; i < METRIC_COUNT; i++) {
+        atomic_clear(&metrics_counters[i]);
+    }
+
+    memset(hists, 0, sizeof(hists));
+}
+
+#ifdef CONFIG_SHELL
+/*---------------------------------------------------------------------------*/
+/*  "metrics": counters, then each histogram with its mean and buckets.      */
+/*---------------------------------------------------------------------------*/
+static int cmd_metrics_show(const struct shell * shell, size_t argc,
+                            char ** argv)
+{
+    struct metrics_hist hist;
+    u32_t count;
+    int   i;
+    int   j;
+
+    for (i = 0; i < METRIC_COUNT; i++) {
+        shell_print(shell, "%-20s %u", metrics_name(i), metrics_get(i));
+    }
+
+    for (i = 0; i < METRIC_HIST_COUNT; i++) {
+        metrics_hist_get(i, &hist);
+        count = atomic_get(&hist.count);
+
+        shell_print(shell, "%-20s n=%u mean=%d", metrics_hist_name(i), count,
+                    count ? (s32_t)atomic_get(&hist.sum) / (s32_t)count : 0);
+
+        for (j = 0; j < METRICS_BUCKETS - 1; j++) {
+            shell_print(shell, "  <%-8d %u", metrics_bucket_bound(i, j),
+                        (u32_t)atomic_get(&hist.bucket[j]));
+        }
+        shell_print(shell, "  >=%-7d %u", metrics_bucket_bound(i, j - 1),
+                    (u32_t)atomic_get(&hist.bucket[j]));
+    }
+
+    return 0;
+}
+
+static int cmd_metrics_reset(const struct shell * shell, size_t argc,
+                             char ** argv)
+{
+    metrics_reset();
+    shell_print(shell, "metrics cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(metrics_cmds,
+    SHELL_CMD(reset, NULL, "Clear all metrics", cmd_metrics_reset),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(metrics, &metrics_cmds, "Show runtime metrics",
+                   cmd_metrics_show);
+#endif  // CONFIG_SHELL
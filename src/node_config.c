@@ -0,0 +1,267 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <init.h>
+#include <string.h>
+#include <sys/byteorder.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#ifdef CONFIG_SETTINGS
+#include <settings/settings.h>
+#endif
+
+#ifdef CONFIG_REBOOT
+#include <power/reboot.h>
+#endif
+
+#include "lora_frame.h"
+#include "lora_prof.h"
+#include "node_config.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <logging/log.h>
+LOG_MODULE_REGISTER(node_config);
+
+struct node_config node_config = {
+    .frequency = NODE_CONFIG_DEFAULT_FREQUENCY,
+    .bandwidth = NODE_CONFIG_DEFAULT_BANDWIDTH,
+    .datarate  = NODE_CONFIG_DEFAULT_DATARATE,
+    .tx_power  = NODE_CONFIG_DEFAULT_TX_POWER,
+    .node_id   = NODE_CONFIG_DEFAULT_NODE_ID,
+    .peer_id   = NODE_CONFIG_DEFAULT_PEER_ID,
+};
+
+/* What the next boot applies: node_config until a new record is written */
+static struct node_config stored;
+
+static char name[NODE_CONFIG_NAME_LEN];
+
+static struct node_config_stats stats;
+
+static struct k_delayed_work reboot_work;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int node_config_decode(const u8_t * buf, u16_t len,
+                              struct node_config * config)
+{
+    struct node_config c;
+
+    if (len != NODE_CONFIG_RECORD_LEN || buf[0] != NODE_CONFIG_VERSION) {
+        return -EINVAL;
+    }
+
+    c.node_id   = buf[1];
+    c.peer_id   = buf[2];
+    c.datarate  = buf[3];
+    c.bandwidth = buf[4];
+    c.tx_power  = (s8_t)buf[5];
+    c.frequency = sys_get_le32(&buf[6]);
+
+    if (c.node_id == LORA_FRAME_BROADCAST || c.node_id == c.peer_id ||
+        c.datarate < LORA_ADR_SF_MIN || c.datarate > LORA_ADR_SF_MAX ||
+        c.bandwidth > BW_500_KHZ ||
+        c.tx_power < LORA_ADR_POWER_MIN || c.tx_power > LORA_ADR_POWER_MAX ||
+        c.frequency < NODE_CONFIG_FREQUENCY_MIN ||
+        c.frequency > NODE_CONFIG_FREQUENCY_MAX) {
+        return -ERANGE;
+    }
+
+    *config = c;
+    return 0;
+}
+
+static void node_config_encode(const struct node_config * config, u8_t * buf)
+{
+    buf[0] = NODE_CONFIG_VERSION;
+    buf[1] = config->node_id;
+    buf[2] = config->peer_id;
+    buf[3] = config->datarate;
+    buf[4] = config->bandwidth;
+    buf[5] = (u8_t)config->tx_power;
+    sys_put_le32(config->frequency, &buf[6]);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  The stored record, for the BLE "Config" read; returns its length.        */
+/*---------------------------------------------------------------------------*/
+int node_config_export(u8_t * buf, u16_t size)
+{
+    if (size < NODE_CONFIG_RECORD_LEN) {
+        return -ENOMEM;
+    }
+
+    node_config_encode(&stored, buf);
+    return NODE_CONFIG_RECORD_LEN;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Check and store a new record, then reset to apply it.  -EINVAL: wrong    */
+/*  length or version; -ERANGE: a value out of range; else a flash error.    */
+/*---------------------------------------------------------------------------*/
+int node_config_import(const u8_t * buf, u16_t len)
+{
+    struct node_config config;
+    int ret;
+
+    ret = node_config_decode(buf, len, &config);
+    if (ret < 0) {
+        return ret;
+    }
+
+#ifdef CONFIG_SETTINGS
+    ret = settings_save_one("node/cfg", buf, len);
+    if (ret < 0) {
+        LOG_ERR("Config save failed: %d", ret);
+        stats.save_errors++;
+        return ret;
+    }
+#endif
+
+    stored = config;
+    stats.saves++;
+
+    LOG_INF("Config stored: node %u peer %u, %uHz SF%u BW%u %ddBm",
+            config.node_id, config.peer_id, config.frequency,
+            config.datarate, config.bandwidth, config.tx_power);
+
+    k_delayed_work_submit(&reboot_work, NODE_CONFIG_REBOOT_MS);
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Stored BLE device name; empty until node_config_set_name().              */
+/*---------------------------------------------------------------------------*/
+const char * node_config_name(void)
+{
+    return name;
+}
+
+int node_config_set_name(const char * new_name)
+{
+    strncpy(name, new_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+
+#ifdef CONFIG_SETTINGS
+    {
+        int ret = settings_save_one("node/name", name, strlen(name) + 1);
+
+        if (ret < 0) {
+            stats.save_errors++;
+            return ret;
+        }
+    }
+#endif
+
+    stats.saves++;
+    return 0;
+}
+
+void node_config_get_stats(struct node_config_stats * out)
+{
+    *out = stats;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void reboot_work_cb(struct k_work * work)
+{
+#ifdef CONFIG_REBOOT
+    LOG_INF("Restarting to apply the new config");
+    sys_reboot(SYS_REBOOT_COLD);
+#else
+    LOG_INF("New config applies at the next reset");
+#endif
+}
+
+#ifdef CONFIG_SETTINGS
+/*---------------------------------------------------------------------------*/
+/*  Settings handler for "node/...": "cfg" is the record, "name" the BLE     */
+/*  device name.  A bad record is ignored and the defaults kept.             */
+/*---------------------------------------------------------------------------*/
+static int node_config_set(const char * key, size_t len,
+                           settings_read_cb read_cb, void * cb_arg)
+{
+    u8_t record[NODE_CONFIG_RECORD_LEN];
+    const char * next;
+    int  ret;
+
+    if (settings_name_steq(key, "cfg", &next) && !next) {
+
+        if (len != sizeof(record)) {
+            LOG_WRN("Stored config ignored: %u bytes", len);
+            return 0;
+        }
+
+        ret = read_cb(cb_arg, record, sizeof(record));
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (node_config_decode(record, len, &node_config) < 0) {
+            LOG_WRN("Stored config ignored: version %u or values", record[0]);
+            return 0;
+        }
+
+        stats.stored = true;
+        return 0;
+    }
+
+    if (settings_name_steq(key, "name", &next) && !next) {
+
+        ret = read_cb(cb_arg, name, MIN(len, sizeof(name) - 1));
+        if (ret < 0) {
+            return ret;
+        }
+
+        name[ret] = '\0';
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(node, "node", NULL, node_config_set, NULL, NULL);
+#endif  // CONFIG_SETTINGS
+
+/*---------------------------------------------------------------------------*/
+/*  Runs before the radio and BLE threads start.                             */
+/*---------------------------------------------------------------------------*/
+static int node_config_init(struct device * dev)
+{
+    struct lora_prof_stamp start;
+
+    ARG_UNUSED(dev);
+
+    lora_prof_stamp(&start);
+
+    k_delayed_work_init(&reboot_work, reboot_work_cb);
+
+#ifdef CONFIG_SETTINGS
+    if (settings_subsys_init() == 0) {
+        settings_load_subtree("node");
+    }
+    else {
+        LOG_ERR("Settings unavailable, config defaults used");
+    }
+#endif
+
+    stats.load_us = lora_prof_elapsed_us(&start);
+
+    stored = node_config;
+
+    LOG_INF("Node %u (%s config, loaded in %uus)", node_config.node_id,
+            stats.stored ? "stored" : "default", stats.load_us);
+
+    return 0;
+}
+
+SYS_INIT(node_config_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
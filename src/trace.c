@@ -0,0 +1,199 @@
+/*
+ *  Copyright (c) 2020  Callender-Consulting
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <init.h>
+#include <stdlib.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#ifdef CONFIG_USE_SEGGER_RTT
+#include <SEGGER_RTT.h>
+#endif
+
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "trace.h"
+
+/*
+ *   Skip mode writes all or nothing, and an RTT buffer holds one byte less
+ *   than its size: never hand it more records than fit in an empty buffer.
+ */
+#define TRACE_EMIT_MAX  (TRACE_RTT_BUFFER_SIZE / sizeof(struct trace_record) - 1)
+
+BUILD_ASSERT((TRACE_RECORDS & (TRACE_RECORDS - 1)) == 0);
+BUILD_ASSERT(TRACE_EMIT_MAX >= 1 &&
+             TRACE_EMIT_MAX * sizeof(struct trace_record) < TRACE_RTT_BUFFER_SIZE);
+
+static struct trace_record ring[TRACE_RECORDS];
+static u32_t head;          // next record to write
+static u32_t tail;          // next record to flush
+
+u8_t trace_level = TRACE_LEVEL_DEFAULT;
+
+static struct trace_stats stats;
+
+static struct k_delayed_work flush_work;
+
+#ifdef CONFIG_USE_SEGGER_RTT
+static u8_t rtt_buffer[TRACE_RTT_BUFFER_SIZE];
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*  Append one record; safe from any context and never blocks.               */
+/*---------------------------------------------------------------------------*/
+void trace_write(trace_event_t event, u8_t src, u8_t seq, u8_t len,
+                 s16_t rssi, s8_t snr)
+{
+    struct trace_record * record;
+    u32_t now = k_cyc_to_us_floor32(k_cycle_get_32());
+    int   key;
+
+    key = irq_lock();
+
+    if (head - tail == TRACE_RECORDS) {
+        stats.dropped++;
+        irq_unlock(key);
+        return;
+    }
+
+    record = &ring[head % TRACE_RECORDS];
+    record->time_us = now;
+    record->event   = event;
+    record->src     = src;
+    record->seq     = seq;
+    record->len     = len;
+    record->rssi    = rssi;
+    record->snr     = snr;
+    record->serial  = stats.written + stats.dropped;
+
+    stats.written++;
+
+    head++;
+
+    irq_unlock(key);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Hand "count" records to the host: all of them or, if the channel has no  */
+/*  room, none.  Without RTT they are only counted.                          */
+/*---------------------------------------------------------------------------*/
+static bool trace_emit(const struct trace_record * records, u32_t count)
+{
+#ifdef CONFIG_USE_SEGGER_RTT
+    return SEGGER_RTT_Write(TRACE_RTT_CHANNEL, records,
+                            count * sizeof(*records)) != 0;
+#else
+    return true;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Drain the ring, at most TRACE_EMIT_MAX records per write.  Records in    */
+/*  [tail, head) are complete, and writers only touch slots past head, so    */
+/*  they are read here without the lock.                                     */
+/*---------------------------------------------------------------------------*/
+void trace_flush(void)
+{
+    u32_t end = head;
+    u32_t count;
+
+    while (tail != end) {
+
+        count = MIN(end - tail, TRACE_RECORDS - tail % TRACE_RECORDS);
+        count = MIN(count, TRACE_EMIT_MAX);
+
+        if (!trace_emit(&ring[tail % TRACE_RECORDS], count)) {
+            break;
+        }
+
+        stats.flushed += count;
+        tail += count;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void trace_flush_work_cb(struct k_work * work)
+{
+    trace_flush();
+    k_delayed_work_submit(&flush_work, TRACE_FLUSH_MS);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void trace_set_level(trace_level_t level)
+{
+    trace_level = MIN(level, TRACE_LEVEL__ALL);
+}
+
+void trace_get_stats(struct trace_stats * out)
+{
+    int key = irq_lock();
+
+    *out = stats;
+    irq_unlock(key);
+}
+
+#ifdef CONFIG_SHELL
+/*---------------------------------------------------------------------------*/
+/*  "trace": counters; "trace level [0-3]": show or set the level.           */
+/*---------------------------------------------------------------------------*/
+static int cmd_trace_show(const struct shell * shell, size_t argc,
+                          char ** argv)
+{
+    struct trace_stats trace;
+
+    trace_get_stats(&trace);
+    shell_print(shell, "level %u, written %u, dropped %u, flushed %u",
+                trace_level, trace.written, trace.dropped, trace.flushed);
+    return 0;
+}
+
+static int cmd_trace_level(const struct shell * shell, size_t argc,
+                           char ** argv)
+{
+    if (argc > 1) {
+        trace_set_level(strtoul(argv[1], NULL, 0));
+    }
+    shell_print(shell, "trace level %u (0 off, 1 errors, 2 packets, 3 all)",
+                trace_level);
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(trace_cmds,
+    SHELL_CMD_ARG(level, NULL, "Show or set the trace level",
+                  cmd_trace_level, 1, 1),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(trace, &trace_cmds, "Packet trace counters",
+                   cmd_trace_show);
+#endif  // CONFIG_SHELL
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int trace_init(struct device * dev)
+{
+    ARG_UNUSED(dev);
+
+#ifdef CONFIG_USE_SEGGER_RTT
+    SEGGER_RTT_ConfigUpBuffer(TRACE_RTT_CHANNEL, "trace", rtt_buffer,
+                              sizeof(rtt_buffer), SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+#endif
+
+    k_delayed_work_init(&flush_work, trace_flush_work_cb);
+    k_delayed_work_submit(&flush_work, TRACE_FLUSH_MS);
+
+    return 0;
+}
+
+SYS_INIT(trace_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);